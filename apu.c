@@ -1,5 +1,11 @@
 #include "nesmu.h"
+#include <math.h>
 #include <stdio.h>
+#include <string.h>
+#include <time.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #define CH0 &(nes->apu.ch[0])
 #define CH1 &(nes->apu.ch[1])
@@ -7,11 +13,21 @@
 #define CH3 &(nes->apu.ch[3])
 #define CH4 &(nes->apu.ch[4])
 
+static void quarter_frame_update(t_nes *nes);
+static void half_frame_update(t_nes *nes);
+static void irq_update(t_nes *nes);
+static void schedule_dmc_sync(t_nes *nes);
+static void schedule_frame_step(t_nes *nes);
+static void dmc_reload(t_channel *, bool);
+static void dmc_next_sample(t_nes *nes, t_channel *);
+
 uint8_t apu_read(t_nes *nes, uint16_t addr) {
     uint8_t val = 0;
+    int i;
 
     switch (addr) {
     case SND_CHN:
+        apu_sync(nes);
         val |= (nes->apu.ch[0].lc.counter > 0) ? 1 : 0;
         val |= (nes->apu.ch[1].lc.counter > 0) ? 2 : 0;
         val |= (nes->apu.ch[2].lc.counter > 0) ? 4 : 0;
@@ -22,26 +38,22 @@ uint8_t apu_read(t_nes *nes, uint16_t addr) {
         val |= nes->apu.frame_interrupt_flag ? 64 : 0;
         val |= nes->apu.dmc_interrupt_flag ? 128 : 0;
         nes->apu.frame_interrupt_flag = false;
+        irq_update(nes);
         return val;
     case JOY1:
+    case JOY2:
+        i = addr - JOY1;
         val = nes->cpu.last_read & 248;
-        val |= (nes->shell.joy1 >> (7 - nes->joy1_read_index)) & 1;
-        nes->joy1_read_index += 1;
+        val |= (nes->joy[i] >> (7 - nes->joy_read_index[i])) & 1;
+        nes->joy_read_index[i] += 1;
         return val;
-    case JOY2:
-        return 0;
 
     default:
         return nes->cpu.last_read;
     }
 }
 
-static void quarter_frame_update(t_nes *nes);
-static void half_frame_update(t_nes *nes);
-static void dmc_reload(t_channel *, bool);
-static void dmc_next_sample(t_nes *nes, t_channel *);
-
-void apu_write(t_nes *nes, uint16_t addr, uint8_t val) {
+static void apu_register_write(t_nes *nes, uint16_t addr, uint8_t val) {
     const uint8_t length_table[] = {
         10, 254, 20, 2,  40, 4,  80, 6,  160, 8,  60, 10, 14, 12, 26, 14,
         12, 16,  24, 18, 48, 20, 96, 22, 192, 24, 72, 26, 16, 28, 32, 30};
@@ -159,12 +171,9 @@ void apu_write(t_nes *nes, uint16_t addr, uint8_t val) {
         }
         break;
 
-    case JOY1:
-        nes->joy1_read_index = 0;
-        break;
-
     case JOY2:
-        nes->apu.cpu_cycles_divided = 0;
+        nes->apu.frame_start = nes->cpu.cycles;
+        nes->apu.frame_step = 0;
         if (val & 128) {
             quarter_frame_update(nes);
             half_frame_update(nes);
@@ -174,12 +183,48 @@ void apu_write(t_nes *nes, uint16_t addr, uint8_t val) {
         nes->apu.interrupt_inhibit_flag = (val & 64) != 0;
         nes->apu.frame_interrupt_flag =
             (val & 64) ? false : nes->apu.frame_interrupt_flag;
-
+        schedule_frame_step(nes);
         break;
 
     default:
         break;
     }
+
+    nes->apu.levels_dirty = true;
+}
+
+// Channel registers only change what is heard, so writes to them are
+// logged with their cycle and played back in order by the next
+// apu_sync(). That happens when the CPU can tell the difference: a $4015
+// read, a frame sequencer step, a possible DMC IRQ, or the end of the
+// frame. Writes that touch the IRQ flags or the frame sequencer ($4010,
+// $4015, $4017) take effect at once.
+void apu_write(t_nes *nes, uint16_t addr, uint8_t val) {
+    t_apu *apu = &(nes->apu);
+
+    if (addr == JOY1) {
+        nes->joy_read_index[0] = 0;
+        nes->joy_read_index[1] = 0;
+        return;
+    }
+
+    if (nes->apu_thread) {
+        apu_thread_push(nes, APU_REC_WRITE, addr, val);
+    }
+
+    if (addr == DMC_FREQ || addr == SND_CHN || addr == JOY2 ||
+        apu->num_writes == APU_WRITE_LOG) {
+        apu_sync(nes);
+        apu_register_write(nes, addr, val);
+        schedule_dmc_sync(nes);
+        irq_update(nes);
+        return;
+    }
+
+    apu->writes[apu->num_writes].cycle = nes->cpu.cycles;
+    apu->writes[apu->num_writes].addr = addr;
+    apu->writes[apu->num_writes].val = val;
+    apu->num_writes += 1;
 }
 
 static void envelope_tick(t_channel *ch) {
@@ -230,31 +275,102 @@ static void length_counter_tick(t_channel *ch, bool disabled_flag) {
     }
 }
 
-static void pulse_timer_tick(t_channel *ch, bool is_phase_advance,
-                             uint8_t phase_mask) {
-    if (ch->timer.divider) {
-        ch->timer.divider -= 1;
-    } else {
-        ch->timer.divider = ch->timer.period;
-        if (is_phase_advance) {
-            ch->timer.phase = (ch->timer.phase + 1) & phase_mask;
+static uint16_t lfsr_next(uint16_t reg, bool mode_flag) {
+    uint16_t bit = reg ^ (reg >> (mode_flag ? 6 : 1));
+    return (reg >> 1) | ((bit & 1) << 14);
+}
+
+static void noise_lfsr_step(t_channel *ch) {
+    ch->lfsr.shift_register =
+        lfsr_next(ch->lfsr.shift_register, ch->lfsr.mode_flag);
+}
+
+// Each step of the shift register is a permutation of its 2^15 states,
+// so a state only ever goes round its own cycle: 32767 states, or 0 on
+// its own, in long mode; 93 states (352 such cycles), 31, or 0 in short
+// mode. The cycles of a mode are laid out in seq longest first, cycles
+// of the same length in a run, and pos is the index of every state in
+// it. n steps move the index by n modulo the length of its cycle.
+#define LFSR_STATES 32768
+#define LFSR_MAX_RUNS 4
+
+typedef struct lfsr_table {
+    uint16_t seq[LFSR_STATES];
+    uint16_t pos[LFSR_STATES];
+    struct {
+        uint16_t len, count;
+    } runs[LFSR_MAX_RUNS];
+    int num_runs;
+} t_lfsr_table;
+
+static t_lfsr_table lfsr_tables[2]; // by mode_flag
+
+static void build_lfsr_table(t_lfsr_table *t, bool mode_flag) {
+    static uint16_t starts[LFSR_STATES], lens[LFSR_STATES];
+    static bool seen[LFSR_STATES];
+    int num_cycles = 0, laid = 0, len, prev_len = LFSR_STATES + 1;
+
+    memset(seen, 0, sizeof(seen));
+    for (int s = 0; s < LFSR_STATES; s++) {
+        if (seen[s])
+            continue;
+        len = 0;
+        for (uint16_t r = s; !seen[r]; r = lfsr_next(r, mode_flag)) {
+            seen[r] = true;
+            len += 1;
         }
+        starts[num_cycles] = s;
+        lens[num_cycles++] = len;
     }
-}
 
-static void noise_timer_tick(t_channel *ch) {
-    uint16_t reg, bit;
+    t->num_runs = 0;
+    while (laid < LFSR_STATES && t->num_runs < LFSR_MAX_RUNS) {
+        // the longest cycles not laid out yet
+        len = 0;
+        for (int c = 0; c < num_cycles; c++) {
+            if (lens[c] < prev_len && lens[c] > len)
+                len = lens[c];
+        }
+        prev_len = len;
+
+        t->runs[t->num_runs].len = len;
+        t->runs[t->num_runs].count = 0;
+        for (int c = 0; c < num_cycles; c++) {
+            uint16_t r = starts[c];
+
+            if (lens[c] != len)
+                continue;
+            for (int i = 0; i < len; i++, r = lfsr_next(r, mode_flag)) {
+                t->seq[laid] = r;
+                t->pos[r] = laid++;
+            }
+            t->runs[t->num_runs].count += 1;
+        }
+        t->num_runs += 1;
+    }
+}
 
-    if (ch->timer.divider) {
-        ch->timer.divider -= 1;
-    } else {
-        ch->timer.divider = ch->timer.period;
+__attribute__((constructor)) static void build_lfsr_tables(void) {
+    build_lfsr_table(&lfsr_tables[0], false);
+    build_lfsr_table(&lfsr_tables[1], true);
+}
 
-        reg = ch->lfsr.shift_register;
-        bit = ch->lfsr.mode_flag ? 6 : 1;
-        bit = reg ^ (reg >> bit);
-        ch->lfsr.shift_register = (reg >> 1) | ((bit & 1) << 14);
+static void noise_lfsr_skip(t_channel *ch, uint64_t n) {
+    const t_lfsr_table *t = &lfsr_tables[ch->lfsr.mode_flag ? 1 : 0];
+    uint32_t idx = t->pos[ch->lfsr.shift_register & (LFSR_STATES - 1)];
+    uint32_t base = 0, size, len, start;
+
+    for (int i = 0; i < t->num_runs; i++) {
+        len = t->runs[i].len;
+        size = len * t->runs[i].count;
+        if (idx < base + size) {
+            start = idx - (idx - base) % len;
+            idx = start + (idx - start + n % len) % len;
+            break;
+        }
+        base += size;
     }
+    ch->lfsr.shift_register = t->seq[idx];
 }
 
 static void dmc_reload(t_channel *ch, bool enabled) {
@@ -290,13 +406,8 @@ static void dmc_next_sample(t_nes *nes, t_channel *ch) {
     }
 }
 
-static void dmc_timer_tick(t_nes *nes, t_channel *ch) {
-    if (ch->dmc.counter) {
-        ch->dmc.counter -= 2; // cpu vs apu
-        return;
-    }
-    ch->dmc.counter = ch->dmc.period;
-
+// one output clock, when the DMC timer reloads
+static void dmc_step(t_nes *nes, t_channel *ch) {
     if (ch->dmc.empty_buffer_flag) {
         dmc_next_sample(nes, ch);
     }
@@ -324,6 +435,16 @@ static void dmc_timer_tick(t_nes *nes, t_channel *ch) {
     ch->dmc.bits_remaining -= 1;
 }
 
+// n clocks with nothing to play: the output unit keeps cycling through
+// silent 8 bit rounds
+static void dmc_idle_steps(t_channel *ch, uint64_t n) {
+    if (n > ch->dmc.bits_remaining) {
+        ch->dmc.silence_flag = true;
+    }
+    ch->dmc.bits_remaining = (ch->dmc.bits_remaining + 8 - n % 8) % 8;
+    ch->dmc.shift_register = (n < 8) ? ch->dmc.shift_register >> n : 0;
+}
+
 static uint8_t pulse_sample(t_channel *ch) {
     if ((ch->sweep.muted) || (!ch->lc.counter))
         return 0;
@@ -384,124 +505,444 @@ static void half_frame_update(t_nes *nes) {
     length_counter_tick(CH3, nes->apu.ch[3].env.loop_flag);
 }
 
-static void apu_timers_tick(t_nes *nes) {
-    // https://www.nesdev.org/wiki/APU#Glossary
-    // The triangle channel's timer is clocked on every CPU cycle,
-    // but the pulse, noise, and DMC timers are clocked only on
-    // every second CPU cycle and thus produce only even periods.
+// the five channel outputs packed, a change is a single compare
+static uint32_t channel_levels(t_nes *nes) {
+    return pulse_sample(CH0) | pulse_sample(CH1) << 4 |
+           triangle_sample(CH2) << 8 | noise_sample(CH3) << 12 |
+           dmc_sample(CH4) << 16;
+}
 
-    nes->apu.timer_cycles++;
+// https://www.nesdev.org/wiki/APU_Mixer lookup tables, at full scale
+// INT16_MAX: pulse by s0 + s1, tnd by 3 * s2 + 2 * s3 + s4
+static int32_t pulse_table[31];
+static int32_t tnd_table[203];
 
-    bool is_phase_advance = (CH2)->lin.counter > 0;
-    is_phase_advance &= (CH2)->lc.counter > 0;
-    // triangle: to avoid "ultrasonic frequencies"
-    // do not change phase when period < 2
-    is_phase_advance &= (CH2)->timer.period > 1;
-    pulse_timer_tick(CH2, is_phase_advance, 31);
+__attribute__((constructor)) static void build_mixer_tables(void) {
+    pulse_table[0] = tnd_table[0] = 0;
+    for (int n = 1; n < 31; n++) {
+        pulse_table[n] = lrint(INT16_MAX * 95.52 / (8128.0 / n + 100.0));
+    }
+    for (int n = 1; n < 203; n++) {
+        tnd_table[n] = lrint(INT16_MAX * 163.67 / (24329.0 / n + 100.0));
+    }
+}
+
+static int32_t mix_levels(uint32_t levels) {
+    uint32_t s0, s1, s2, s3, s4;
+
+    s0 = levels & 15;
+    s1 = (levels >> 4) & 15;
+    s2 = (levels >> 8) & 15;
+    s3 = (levels >> 12) & 15;
+    s4 = (levels >> 16) & 127;
+
+    return pulse_table[s0 + s1] + tnd_table[3 * s2 + 2 * s3 + s4];
+}
 
-    if (nes->apu.timer_cycles < 2)
+// the mixer output only goes to blip when a channel output changed
+static void mix_update(t_nes *nes, uint64_t when) {
+    uint32_t levels;
+    int32_t level;
+
+    if (nes->apu.silent)
+        return;
+
+    levels = channel_levels(nes);
+    if (levels == nes->apu.levels)
         return;
-    nes->apu.timer_cycles -= 2;
 
-    pulse_timer_tick(CH0, true, 7);
-    pulse_timer_tick(CH1, true, 7);
-    noise_timer_tick(CH3);
-    dmc_timer_tick(nes, CH4);
+    level = mix_levels(levels);
+    blip_add_delta(&nes->apu.blip, when - nes->apu.blip_cycles,
+                   level - nes->apu.level);
+    nes->apu.levels = levels;
+    nes->apu.level = level;
 }
 
-static int16_t mix_samples(t_nes *nes) {
-    // https://www.nesdev.org/wiki/APU_Mixer
+// DC blocking: the DC estimate (a one pole low-pass, 0.999929 per cpu
+// cycle, ~20 Hz) is advanced once per block of DC_BLOCK samples from the
+// block mean, and interpolated linearly across the block, so that the
+// per-sample work is a subtract and a saturating pack, done with SSE2.
+// The estimate is kept in Q8.
+
+#define DC_BLOCK 64
+#define DC_POLE 0.999929
+#define DC_SHIFT 8
+
+static int32_t dc_decay[DC_BLOCK + 1]; // 1 - pole^n for n samples, Q16
 
-    double calc, pulse_out, tnd_out, output;
-    int16_t s0, s1, s2, s3, s4;
-    int32_t out;
+__attribute__((constructor)) static void build_dc_decay(void) {
+    double per_sample = pow(DC_POLE, (double)CPU_FREQUENCY / SAMPLING_FREQUENCY);
 
-    s0 = s1 = s2 = s3 = s4 = 0;
-    s0 = pulse_sample(CH0);
-    s1 = pulse_sample(CH1);
-    s2 = triangle_sample(CH2);
-    s3 = noise_sample(CH3);
-    s4 = dmc_sample(CH4);
-    // s0 = s1 = s2 = s3 = s4 = 0;
+    for (int n = 0; n <= DC_BLOCK; n++) {
+        dc_decay[n] = lrint((1.0 - pow(per_sample, n)) * 65536);
+    }
+}
+
+// levels are the mixer output from blip, out gets n samples, n <= DC_BLOCK
+static void dc_filter_block(t_apu *apu, const int32_t *levels, int16_t *out,
+                            int n) {
+    int64_t sum = 0;
+    int32_t dc, step, mean;
+    int i = 0;
 
-    pulse_out = 0.0;
-    if (s0 || s1) {
-        pulse_out = 95.88 / (8128.0 / (double)(s0 + s1) + 100.0);
+    for (int j = 0; j < n; j++) {
+        sum += levels[j];
     }
+    mean = (int32_t)((sum << DC_SHIFT) / n);
+
+    dc = apu->dc;
+    apu->dc += (int32_t)(((int64_t)(mean - dc) * dc_decay[n]) >> 16);
+    step = (apu->dc - dc) / n;
+
+#ifdef __SSE2__
+    __m128i vdc = _mm_add_epi32(_mm_set1_epi32(dc),
+                                _mm_setr_epi32(step, 2 * step, 3 * step,
+                                               4 * step));
+    __m128i vstep = _mm_set1_epi32(4 * step);
+
+    for (; i + 8 <= n; i += 8) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(levels + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(levels + i + 4));
+
+        a = _mm_sub_epi32(_mm_slli_epi32(a, DC_SHIFT), vdc);
+        vdc = _mm_add_epi32(vdc, vstep);
+        b = _mm_sub_epi32(_mm_slli_epi32(b, DC_SHIFT), vdc);
+        vdc = _mm_add_epi32(vdc, vstep);
+        a = _mm_srai_epi32(a, DC_SHIFT - 1); // gain of 2
+        b = _mm_srai_epi32(b, DC_SHIFT - 1);
+        _mm_storeu_si128((__m128i *)(out + i), _mm_packs_epi32(a, b));
+    }
+#endif
 
-    tnd_out = 0.0;
-    if (s2 || s3 || s4) {
-        calc = s2 / 8227.0 + s3 / 12241.0 + s4 / 22638.0;
-        tnd_out = 159.79 / (1.0 / calc + 100.0);
+    for (; i < n; i++) {
+        int32_t v = ((levels[i] << DC_SHIFT) - (dc + (i + 1) * step)) >>
+                    (DC_SHIFT - 1);
+        out[i] = v > INT16_MAX ? INT16_MAX : v < INT16_MIN ? INT16_MIN : v;
     }
+}
 
-    calc = (pulse_out + tnd_out) * 2.0;
-    output = calc - nes->apu.capacitor;
-    nes->apu.capacitor = calc - output * 0.999929;
-    out = (double)INT16_MAX * output;
-    out = out > INT16_MAX ? INT16_MAX : out;
-    out = out < INT16_MIN ? INT16_MIN : out;
-    return (int16_t)out;
+// move the samples blip has finished through the DC blocking filter into
+// the buffer the host drains, it is drained once per frame and what
+// doesn't fit is dropped. Only whole blocks are filtered, so the output
+// does not depend on when the APU happens to be synced.
+static void audio_output(t_nes *nes) {
+    int32_t levels[DC_BLOCK];
+    int16_t samples[DC_BLOCK];
+    uint32_t room;
+    int n;
+
+    if (nes->apu.silent)
+        return;
+
+    blip_end_frame(&nes->apu.blip, nes->apu.sync_cycles - nes->apu.blip_cycles);
+    nes->apu.blip_cycles = nes->apu.sync_cycles;
+
+    while (blip_samples_avail(&nes->apu.blip) >= DC_BLOCK) {
+        n = blip_read_samples(&nes->apu.blip, levels, DC_BLOCK);
+        dc_filter_block(&nes->apu, levels, samples, n);
+
+        room = AUDIO_BUF_SIZE - nes->audio_len;
+        n = ((uint32_t)n < room) ? n : (int)room;
+        memcpy(nes->audio_buf + nes->audio_len, samples, n * sizeof(int16_t));
+        nes->audio_len += n;
+    }
 }
 
-static void apu_tick(t_nes *nes) {
+static const uint32_t sequencer_steps[2][4] = {
+    {7457, 14913, 22371, 29830},
+    {7457, 14913, 22371, 37282},
+};
+
+// Channel timers. A timer with divider d and period p clocks its channel
+// on the (d + 1)th clock and every p + 1 clocks after that.
+// https://www.nesdev.org/wiki/APU#Glossary
+// The triangle channel's timer is clocked on every CPU cycle,
+// but the pulse, noise, and DMC timers are clocked only on
+// every second CPU cycle (odd ones) and thus produce only even periods.
+
+// cpu cycle of the nth timer clock at or after `when`, n >= 1
+static uint64_t clock_time(int i, uint64_t when, uint64_t n) {
+    return (i == 2) ? when + n - 1 : (when | 1) + 2 * (n - 1);
+}
 
-    // 2 cpu cycles == 1 apu cycles
-    // cpu rate: 1,789,773 Hz per second
-    uint32_t i, j;
-    uint32_t sequencer_steps[2][4] = {
-        {7457, 14913, 22371, 29830},
-        {7457, 14913, 22371, 37282},
-    };
-    i = (int)nes->apu.frame_counter_mode;
+// timer clocks in [from, to)
+static uint64_t clocks_between(int i, uint64_t from, uint64_t to) {
+    return (i == 2) ? to - from : to / 2 - from / 2;
+}
+
+// the DMC counts down in cpu cycles, 2 per clock, all rates are even
+static uint16_t timer_period(t_channel *ch, int i) {
+    return (i == 4) ? ch->dmc.period / 2 : ch->timer.period;
+}
+
+static uint16_t timer_divider(t_channel *ch, int i) {
+    return (i == 4) ? ch->dmc.counter / 2 : ch->timer.divider;
+}
 
-    nes->apu.cpu_cycles += 1;
-    nes->apu.cpu_cycles_divided += 1;
+static void set_timer_divider(t_channel *ch, int i, uint16_t divider) {
+    if (i == 4)
+        ch->dmc.counter = divider * 2;
+    else
+        ch->timer.divider = divider;
+}
 
-    j = nes->apu.cpu_cycles_divided;
+// false when no clock of the channel can change its output until the next
+// register write or frame sequencer step
+static bool channel_audible(t_channel *ch, int i) {
+    uint8_t volume = ch->env.constant_volume ? ch->env.period : ch->env.decay;
 
-    if (j == sequencer_steps[i][0]) {
+    switch (i) {
+    case 0:
+    case 1:
+        return !ch->sweep.muted && ch->lc.counter && volume;
+    case 2:
+        // triangle: to avoid "ultrasonic frequencies"
+        // do not change phase when period < 2
+        return ch->lin.counter && ch->lc.counter && ch->timer.period > 1;
+    case 3:
+        return ch->lc.counter && volume;
+    default:
+        return !ch->dmc.silence_flag || !ch->dmc.empty_buffer_flag ||
+               ch->dmc.sample_length;
+    }
+}
+
+static void channel_step(t_nes *nes, t_channel *ch, int i) {
+    switch (i) {
+    case 0:
+    case 1:
+        ch->timer.phase = (ch->timer.phase + 1) & 7;
+        break;
+    case 2:
+        ch->timer.phase = (ch->timer.phase + 1) & 31;
+        break;
+    case 3:
+        noise_lfsr_step(ch);
+        break;
+    default:
+        dmc_step(nes, ch);
+        break;
+    }
+}
+
+// n clocks of a channel that is not audible, in closed form
+static void channel_skip(t_channel *ch, int i, uint64_t n) {
+    switch (i) {
+    case 0:
+    case 1:
+        ch->timer.phase = (ch->timer.phase + n) & 7;
+        break;
+    case 2:
+        break;
+    case 3:
+        noise_lfsr_skip(ch, n);
+        break;
+    default:
+        dmc_idle_steps(ch, n);
+        break;
+    }
+}
+
+// Run all channels from sync_cycles up to `to`. Silent channels are
+// advanced in one go. The others only stop at their own clocks, where
+// the mixer is updated, instead of on every cycle.
+static void apu_run(t_nes *nes, uint64_t to) {
+    uint64_t from = nes->apu.sync_cycles, next[5], when;
+    bool audible[5] = {false};
+    int first = nes->apu.silent ? 4 : 0; // the cpu only sees the DMC timer
+
+    if (from >= to)
+        return;
+
+    when = UINT64_MAX;
+    for (int i = first; i < 5; i++) {
+        t_channel *ch = &(nes->apu.ch[i]);
+        uint64_t d = timer_divider(ch, i), p = timer_period(ch, i);
+        uint64_t n = clocks_between(i, from, to);
+
+        audible[i] = channel_audible(ch, i);
+        next[i] = UINT64_MAX;
+
+        if (audible[i]) {
+            next[i] = clock_time(i, from, d + 1);
+            when = (next[i] < when) ? next[i] : when;
+        } else if (n <= d) {
+            set_timer_divider(ch, i, d - n);
+        } else {
+            set_timer_divider(ch, i, p - (n - d - 1) % (p + 1));
+            channel_skip(ch, i, 1 + (n - d - 1) / (p + 1));
+        }
+    }
+
+    // register writes and frame sequencer steps set levels_dirty
+    if (nes->apu.levels_dirty && when != from) {
+        mix_update(nes, from);
+    }
+    nes->apu.levels_dirty = false;
+
+    while (when < to) {
+        uint64_t now = when;
+
+        when = UINT64_MAX;
+        for (int i = first; i < 5; i++) {
+            if (next[i] == now) {
+                t_channel *ch = &(nes->apu.ch[i]);
+
+                channel_step(nes, ch, i);
+                next[i] = clock_time(i, now + 1, timer_period(ch, i) + 1);
+            }
+            when = (next[i] < when) ? next[i] : when;
+        }
+        mix_update(nes, now);
+    }
+
+    for (int i = first; i < 5; i++) {
+        if (audible[i]) {
+            set_timer_divider(&(nes->apu.ch[i]), i,
+                              clocks_between(i, to, next[i]));
+        }
+    }
+    nes->apu.sync_cycles = to;
+}
+
+static void irq_update(t_nes *nes) {
+    nes->cpu.irq_line =
+        (nes->apu.frame_interrupt_flag) || (nes->apu.dmc_interrupt_flag);
+    if ((nes->cpu.irq_line) && (!cpu_is_iflag(nes))) {
+        sched_set(nes, EV_IRQ, nes->cpu.cycles);
+    }
+}
+
+// while a DMC IRQ can still fire, catch up often enough to notice it:
+// fetches are 8 bit clocks apart, so the sample can not end sooner than
+// its remaining bytes take to play; the last byte is polled every boundary
+static void schedule_dmc_sync(t_nes *nes) {
+    t_dmc *dmc = &(nes->apu.ch[4].dmc);
+    uint64_t wait;
+
+    if ((!dmc->irq_enabled_flag) || (dmc->loop_flag) ||
+        (dmc->sample_length == 0)) {
+        return;
+    }
+
+    wait = (uint64_t)dmc->period * 8 * (dmc->sample_length - 1);
+    wait = (wait > 0) ? wait : 1;
+    sched_set(nes, EV_APU_SYNC, nes->apu.sync_cycles + wait);
+}
+
+static void schedule_frame_step(t_nes *nes) {
+    int mode = (int)nes->apu.frame_counter_mode;
+    uint64_t when =
+        nes->apu.frame_start + sequencer_steps[mode][nes->apu.frame_step];
+    sched_set(nes, EV_APU_FRAME, when);
+}
+
+#ifdef NESMU_PROFILE
+static uint64_t profile_ns(void) {
+    struct timespec ts;
+
+    (void)clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+#endif
+
+// run the channels up to the current cpu cycle, applying the logged
+// register writes on the way
+void apu_sync(t_nes *nes) {
+#ifdef NESMU_PROFILE
+    uint64_t start = profile_ns();
+#endif
+
+    for (int i = 0; i < nes->apu.num_writes; i++) {
+        t_apu_write *w = &(nes->apu.writes[i]);
+
+        apu_run(nes, w->cycle);
+        apu_register_write(nes, w->addr, w->val);
+    }
+    nes->apu.num_writes = 0;
+
+    apu_run(nes, nes->cpu.cycles);
+    audio_output(nes);
+    irq_update(nes);
+
+#ifdef NESMU_PROFILE
+    nes->apu.profile_ns += profile_ns() - start;
+#endif
+}
+
+// the host resamples a little faster or slower to follow its audio
+// device, ppm away from SAMPLING_FREQUENCY. Samples synthesized so far
+// keep the old rate.
+void apu_set_rate(t_nes *nes, int32_t ppm) {
+    if (nes->apu_thread) {
+        apu_thread_set_rate(nes, ppm);
+        return;
+    }
+
+    apu_sync(nes);
+    blip_set_rate(&nes->apu.blip, CPU_FREQUENCY,
+                  SAMPLING_FREQUENCY * (1 + ppm / 1e6));
+}
+
+void apu_init(t_nes *nes) {
+    /* start triangle at phase 16 (volume 0) to avoid initial pop */
+    nes->apu.ch[2].timer.phase = 16;
+    nes->apu.ch[3].lfsr.shift_register = 1;
+
+    nes->apu.sync_cycles = 0;
+    nes->apu.blip_cycles = 0;
+    blip_init(&nes->apu.blip, CPU_FREQUENCY, SAMPLING_FREQUENCY);
+    nes->apu.frame_start = 0;
+    nes->apu.frame_step = 0;
+    schedule_frame_step(nes);
+}
+
+void apu_frame_event(t_nes *nes) {
+    int mode = (int)nes->apu.frame_counter_mode;
+
+    if (nes->apu_thread) {
+        apu_thread_push(nes, APU_REC_FRAME_STEP, 0, 0);
+    }
+    apu_sync(nes);
+
+    switch (nes->apu.frame_step) {
+    case 0:
+    case 2:
         quarter_frame_update(nes);
-    } else if (j == sequencer_steps[i][1]) {
+        break;
+    case 1:
         quarter_frame_update(nes);
         half_frame_update(nes);
-    } else if (j == sequencer_steps[i][2]) {
-        quarter_frame_update(nes);
-    } else if (j >= sequencer_steps[i][3]) {
+        break;
+    default:
         quarter_frame_update(nes);
         half_frame_update(nes);
 
-        nes->apu.cpu_cycles_divided -= sequencer_steps[i][3];
-        if ((i == 0) && (!nes->apu.interrupt_inhibit_flag)) {
+        nes->apu.frame_start += sequencer_steps[mode][3];
+        if ((mode == 0) && (!nes->apu.interrupt_inhibit_flag)) {
             nes->apu.frame_interrupt_flag = true;
         }
-    } else {
-    }
-
-    if ((nes->apu.frame_interrupt_flag) || (nes->apu.dmc_interrupt_flag)) {
-        int new_cycles = do_irq(&(nes->cpu));
-        nes->cpu.cycles += new_cycles;
-        if (new_cycles) {
-            puts("APU MODE 0 IRQ");
-        }
+        break;
     }
 
-    apu_timers_tick(nes);
-
-    int16_t sample = mix_samples(nes);
+    nes->apu.levels_dirty = true;
+    nes->apu.frame_step = (nes->apu.frame_step + 1) & 3;
+    schedule_frame_step(nes);
+    irq_update(nes);
+}
 
-    /* (1_789_773 * 16000) / 48000 == 596591.0 */
-    nes->apu.audio_output_cycles += 16000;
-    while (nes->apu.audio_output_cycles >= 596591) {
-        nes->apu.audio_output_cycles -= 596591;
-        audio_enqueue_sample(nes, sample);
-    }
+void apu_sync_event(t_nes *nes) {
+    apu_sync(nes);
+    schedule_dmc_sync(nes);
 }
 
-int apu_update(t_nes *nes) {
-    uint32_t new_cpu_cycles = nes->cpu.cycles - nes->prev_cpu_cycles;
-    while (new_cpu_cycles--) {
-        apu_tick(nes);
+void apu_irq_event(t_nes *nes) {
+    if (!nes->cpu.irq_line)
+        return;
+
+    int new_cycles = do_irq(&(nes->cpu));
+    nes->cpu.cycles += new_cycles;
+    if (new_cycles && nes->trace) {
+        puts("APU MODE 0 IRQ");
     }
-    return 0;
 }
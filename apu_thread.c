@@ -0,0 +1,193 @@
+#include "nesmu.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Audio synthesis on a thread of its own (nesmu_set_audio_thread()).
+//
+// The main thread keeps running the APU for what the CPU can observe
+// ($4015, the frame and DMC IRQs) with apu.silent set, so that only the
+// DMC timer and the frame sequencer are run. Every register write and
+// frame sequencer step is also sent, with its cpu cycle, to a second
+// t_nes owned by the synthesis thread, which plays them through the very
+// same apu_write() and apu_frame_event() and does the mixing, blip and
+// filtering. Both see the same inputs at the same cycles, so the samples
+// are the ones the inline APU would have produced.
+//
+// Records go through a single producer, single consumer ring (ring.c),
+// the synthesis thread sleeps while it is empty. Samples come back
+// through a ring of their own that neither side ever waits on: the
+// writer fills a slot then publishes its index with a release store, the
+// reader acquires the index before looking at the slot. At the end of a
+// frame the main thread waits for the frame before it, so synthesis runs
+// one frame behind and the host still gets its audio every frame.
+
+#define QUEUE_SIZE 8192   // records, a power of two
+#define SAMPLES_SIZE 8192 // samples, a power of two
+
+enum { APU_REC_STOP = APU_REC_RATE + 1 };
+
+typedef struct apu_record {
+    uint64_t cycle;
+    uint16_t addr;
+    uint8_t val;
+    uint8_t kind;
+    int32_t ppm; // APU_REC_RATE
+} t_apu_record;
+
+struct apu_thread {
+    pthread_t thread;
+    t_nes *synth; // only its APU and memory (DMC samples) are used
+    uint32_t frames_sent;
+
+    t_ring queue;
+
+    int16_t samples[SAMPLES_SIZE];
+    atomic_uint samples_read, samples_write;
+    atomic_uint frames_done;
+};
+
+// synthesis thread: hand the samples of a frame to the main thread, what
+// does not fit is dropped, as with the inline buffer
+static void publish_samples(struct apu_thread *t) {
+    t_nes *synth = t->synth;
+    uint32_t w = atomic_load_explicit(&t->samples_write, memory_order_relaxed);
+    uint32_t r = atomic_load_explicit(&t->samples_read, memory_order_acquire);
+
+    for (uint32_t i = 0; i < synth->audio_len && w - r < SAMPLES_SIZE; i++) {
+        t->samples[w++ & (SAMPLES_SIZE - 1)] = synth->audio_buf[i];
+    }
+    synth->audio_len = 0;
+    atomic_store_explicit(&t->samples_write, w, memory_order_release);
+}
+
+static void *synth_main(void *arg) {
+    struct apu_thread *t = arg;
+    t_nes *synth = t->synth;
+    t_apu_record rec;
+
+    for (;;) {
+        ring_pop(&t->queue, &rec);
+        synth->cpu.cycles = rec.cycle;
+        switch (rec.kind) {
+        case APU_REC_WRITE:
+            apu_write(synth, rec.addr, rec.val);
+            break;
+        case APU_REC_FRAME_STEP:
+            apu_frame_event(synth);
+            break;
+        case APU_REC_RATE:
+            apu_set_rate(synth, rec.ppm);
+            break;
+        case APU_REC_END_FRAME:
+            apu_sync(synth);
+            publish_samples(t);
+            atomic_fetch_add(&t->frames_done, 1);
+            ring_wake(&t->queue);
+            break;
+        default:
+            return NULL;
+        }
+    }
+}
+
+// main thread. Records are never dropped, if synthesis is that far
+// behind the emulation waits for it. The synthesis thread is only woken
+// up at the end of a frame, or when the ring fills up.
+void apu_thread_push(t_nes *nes, int kind, uint16_t addr, uint8_t val) {
+    struct apu_thread *t = nes->apu_thread;
+    t_apu_record rec = {nes->cpu.cycles, addr, val, kind, 0};
+
+    ring_push(&t->queue, &rec);
+    if (kind == APU_REC_END_FRAME || kind == APU_REC_STOP) {
+        ring_flush(&t->queue);
+    }
+}
+
+void apu_thread_set_rate(t_nes *nes, int32_t ppm) {
+    t_apu_record rec = {nes->cpu.cycles, 0, 0, APU_REC_RATE, ppm};
+
+    ring_push(&nes->apu_thread->queue, &rec);
+}
+
+// close the frame and wait until the previous one has been synthesized
+void apu_thread_end_frame(t_nes *nes) {
+    struct apu_thread *t = nes->apu_thread;
+    uint32_t done;
+
+    apu_thread_push(nes, APU_REC_END_FRAME, 0, 0);
+    t->frames_sent += 1;
+    while ((done = atomic_load(&t->frames_done)) + 1 < t->frames_sent) {
+        ring_wait(&t->queue, &t->frames_done, done);
+    }
+}
+
+size_t apu_thread_drain(t_nes *nes, int16_t *buf, size_t max) {
+    struct apu_thread *t = nes->apu_thread;
+    uint32_t r = atomic_load_explicit(&t->samples_read, memory_order_relaxed);
+    uint32_t w = atomic_load_explicit(&t->samples_write, memory_order_acquire);
+    size_t n;
+
+    for (n = 0; n < max && r != w; n++) {
+        buf[n] = t->samples[r++ & (SAMPLES_SIZE - 1)];
+    }
+    atomic_store_explicit(&t->samples_read, r, memory_order_release);
+    return n;
+}
+
+// the synthesis APU takes over the state of the inline one
+int apu_thread_start(t_nes *nes) {
+    struct apu_thread *t = calloc(1, sizeof(*t));
+
+    if (!t) {
+        return 1;
+    }
+    t->synth = calloc(1, sizeof(t_nes));
+    if (!t->synth || ring_init(&t->queue, QUEUE_SIZE, sizeof(t_apu_record))) {
+        free(t->synth);
+        free(t);
+        return 1;
+    }
+
+    apu_sync(nes);
+    memcpy(t->synth->memory, nes->memory, sizeof(nes->memory));
+    sched_init(t->synth);
+    t->synth->apu = nes->apu;
+    t->synth->cpu.cycles = nes->cpu.cycles;
+
+    if (pthread_create(&t->thread, NULL, synth_main, t) != 0) {
+        ring_destroy(&t->queue);
+        free(t->synth);
+        free(t);
+        return 1;
+    }
+
+    nes->apu.silent = true;
+    nes->apu_thread = t;
+    return 0;
+}
+
+// synthesize what is left, the pending samples go back to the inline
+// buffer and so does the APU state, except for the frame IRQ flag: $4015
+// reads that clear it only ever happen on the main thread
+void apu_thread_stop(t_nes *nes) {
+    struct apu_thread *t = nes->apu_thread;
+    bool frame_interrupt_flag = nes->apu.frame_interrupt_flag;
+    int16_t *buf = nes->audio_buf;
+
+    apu_sync(nes);
+    apu_thread_push(nes, APU_REC_END_FRAME, 0, 0);
+    apu_thread_push(nes, APU_REC_STOP, 0, 0);
+    pthread_join(t->thread, NULL);
+
+    nes->audio_len += apu_thread_drain(nes, buf + nes->audio_len,
+                                       AUDIO_BUF_SIZE - nes->audio_len);
+    nes->apu = t->synth->apu;
+    nes->apu.frame_interrupt_flag = frame_interrupt_flag;
+    nes->apu_thread = NULL;
+
+    ring_destroy(&t->queue);
+    free(t->synth);
+    free(t);
+}
@@ -0,0 +1,118 @@
+#include "libnesmu.h"
+#include "shell.h"
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+
+// Benchmark mode (nesmu -b): runs each ROM headless for a fixed number of
+// frames, one after the other on a single thread, and prints the results
+// as JSON. ns_per_apu_tick needs a -DNESMU_PROFILE build (make bench), and
+// ns_per_run_opcode is the time left once the APU is subtracted, so it
+// also covers scheduler and PPU event overhead. A ROM that cannot be
+// loaded gets an "error" entry, the others are still run.
+
+#define DEFAULT_BENCH_FRAMES 3600
+
+typedef struct bench {
+    const char *path;
+    long frames;
+    double seconds;
+    t_nesmu_stats stats;
+} t_bench;
+
+static double now_seconds(void) {
+    struct timespec ts;
+
+    (void)clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// a ROM that halts (test ROMs end in an endless loop) stops early, the
+// frames actually run are reported
+static int bench_rom(t_bench *b, long max_frames) {
+    int16_t samples[1024];
+    double start;
+    t_nes *nes = open_rom(b->path);
+
+    if (!nes) {
+        return 1;
+    }
+
+    start = now_seconds();
+    for (b->frames = 0; b->frames < max_frames; b->frames++) {
+        if (nesmu_step_frame(nes))
+            break;
+        while (nesmu_drain_audio(nes, samples, 1024) > 0) {
+        }
+    }
+    b->seconds = now_seconds() - start;
+
+    nesmu_get_stats(nes, &b->stats);
+    nesmu_destroy(nes);
+    return 0;
+}
+
+static double per(double num, double den) { return den > 0 ? num / den : 0; }
+
+static void print_bench(const t_bench *b, const char *indent) {
+    const t_nesmu_stats *s = &b->stats;
+    double apu_seconds = s->apu_ns / 1e9;
+    double cpu_seconds = b->seconds - apu_seconds;
+
+    printf("%s\"frames\": %ld,\n", indent, b->frames);
+    printf("%s\"seconds\": %.6f,\n", indent, b->seconds);
+    printf("%s\"instructions\": %" PRIu64 ",\n", indent, s->instructions);
+    printf("%s\"cpu_cycles\": %" PRIu64 ",\n", indent, s->cpu_cycles);
+    printf("%s\"apu_ticks\": %" PRIu64 ",\n", indent, s->apu_ticks);
+    printf("%s\"instructions_per_second\": %.0f,\n", indent,
+           per(s->instructions, b->seconds));
+    printf("%s\"frames_per_second\": %.2f,\n", indent,
+           per(b->frames, b->seconds));
+    printf("%s\"ns_per_run_opcode\": %.3f,\n", indent,
+           per(cpu_seconds * 1e9, s->instructions));
+    printf("%s\"ns_per_apu_tick\": %.3f\n", indent,
+           per(s->apu_ns, s->apu_ticks));
+}
+
+int run_bench(char **paths, int num_paths, long max_frames) {
+    t_bench total;
+    struct rusage ru;
+    int failed = 0;
+
+    memset(&total, 0, sizeof(total));
+    max_frames = max_frames ? max_frames : DEFAULT_BENCH_FRAMES;
+
+    printf("{\n  \"frames_requested\": %ld,\n  \"roms\": [\n", max_frames);
+    for (int i = 0; i < num_paths; i++) {
+        t_bench b = {.path = paths[i]};
+
+        printf("    {\n      \"rom\": ");
+        print_json_string(b.path);
+        if (bench_rom(&b, max_frames)) {
+            printf(",\n      \"error\": \"could not load the rom\"\n");
+            printf("    }%s\n", (i + 1 < num_paths) ? "," : "");
+            failed = 1;
+            continue;
+        }
+
+        printf(",\n");
+        print_bench(&b, "      ");
+        printf("    }%s\n", (i + 1 < num_paths) ? "," : "");
+
+        total.frames += b.frames;
+        total.seconds += b.seconds;
+        total.stats.instructions += b.stats.instructions;
+        total.stats.cpu_cycles += b.stats.cpu_cycles;
+        total.stats.apu_ticks += b.stats.apu_ticks;
+        total.stats.apu_ns += b.stats.apu_ns;
+    }
+    printf("  ],\n  \"total\": {\n");
+    print_bench(&total, "    ");
+    printf("  },\n");
+
+    (void)getrusage(RUSAGE_SELF, &ru);
+    printf("  \"peak_rss_kb\": %ld\n}\n", ru.ru_maxrss);
+    return failed;
+}
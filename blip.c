@@ -0,0 +1,108 @@
+#include "nesmu.h"
+#include <math.h>
+#include <string.h>
+
+// Band-limited step synthesis. Instead of sampling the mixer output at
+// the cpu clock and throwing most of it away, the APU reports each
+// change of its output level as a delta at a cpu cycle. Every delta adds
+// a band-limited step (the running sum of a windowed sinc impulse) to
+// the output buffer, so only as many samples as are played are ever
+// computed, and nothing above the output Nyquist frequency aliases back.
+//
+// Times are 32.32 fixed point output samples. The impulse is centered
+// BLIP_WIDTH / 2 samples after the delta, samples before the current
+// time are final and can be read.
+
+#define BLIP_FRAC_BITS 32
+#define BLIP_PHASE_BITS 5
+#define BLIP_PHASES (1 << BLIP_PHASE_BITS)
+#define BLIP_KERNEL_BITS 15
+#define BLIP_CUTOFF 0.90 // of the output Nyquist frequency
+
+static int16_t blip_kernel[BLIP_PHASES][BLIP_WIDTH];
+
+// Blackman windowed sinc, every phase sums to exactly 1 << BLIP_KERNEL_BITS
+// so that a step always settles on its full height
+__attribute__((constructor)) static void build_kernel(void) {
+    for (int p = 0; p < BLIP_PHASES; p++) {
+        double taps[BLIP_WIDTH], sum = 0;
+        int total = 0, peak = 0;
+
+        for (int i = 0; i < BLIP_WIDTH; i++) {
+            double x = i - BLIP_WIDTH / 2 + 1 - (double)p / BLIP_PHASES;
+            double w = x / BLIP_WIDTH + 0.5;
+            double s = (x == 0) ? 1 : sin(M_PI * BLIP_CUTOFF * x) /
+                                           (M_PI * BLIP_CUTOFF * x);
+
+            w = 0.42 - 0.5 * cos(2 * M_PI * w) + 0.08 * cos(4 * M_PI * w);
+            taps[i] = s * w;
+            sum += taps[i];
+        }
+
+        for (int i = 0; i < BLIP_WIDTH; i++) {
+            blip_kernel[p][i] =
+                (int16_t)lrint(taps[i] / sum * (1 << BLIP_KERNEL_BITS));
+            total += blip_kernel[p][i];
+            peak = (blip_kernel[p][i] > blip_kernel[p][peak]) ? i : peak;
+        }
+        blip_kernel[p][peak] += (1 << BLIP_KERNEL_BITS) - total;
+    }
+}
+
+void blip_init(t_blip *b, double clock_rate, double sample_rate) {
+    memset(b, 0, sizeof(*b));
+    blip_set_rate(b, clock_rate, sample_rate);
+}
+
+// takes effect from the start of the current clock span
+void blip_set_rate(t_blip *b, double clock_rate, double sample_rate) {
+    b->factor = (uint64_t)llround(sample_rate / clock_rate *
+                                  ((uint64_t)1 << BLIP_FRAC_BITS));
+}
+
+// delta is the change of the output level at clock, counted from the last
+// blip_end_frame()
+void blip_add_delta(t_blip *b, uint32_t clock, int32_t delta) {
+    uint64_t time = b->offset + clock * b->factor;
+    uint32_t pos = time >> BLIP_FRAC_BITS;
+    int phase = (time >> (BLIP_FRAC_BITS - BLIP_PHASE_BITS)) & (BLIP_PHASES - 1);
+    int32_t *out = b->buf + pos;
+
+    if (pos >= BLIP_SIZE) {
+        return; // nobody read the buffer for too long, drop the delta
+    }
+
+    for (int i = 0; i < BLIP_WIDTH; i++) {
+        out[i] += blip_kernel[phase][i] * delta;
+    }
+}
+
+// the next clock span starts clocks after the current one
+void blip_end_frame(t_blip *b, uint32_t clocks) {
+    b->offset += clocks * b->factor;
+}
+
+int blip_samples_avail(const t_blip *b) {
+    uint32_t avail = b->offset >> BLIP_FRAC_BITS;
+    return (avail < BLIP_SIZE) ? avail : BLIP_SIZE;
+}
+
+// read up to count finished samples, as levels (the sum of all deltas)
+int blip_read_samples(t_blip *b, int32_t *out, int count) {
+    int avail = blip_samples_avail(b);
+    int used = avail + BLIP_WIDTH + 1; // nothing is written past this
+    int32_t sum = b->integrator;
+
+    count = (count < avail) ? count : avail;
+    for (int i = 0; i < count; i++) {
+        sum += b->buf[i];
+        out[i] = sum >> BLIP_KERNEL_BITS;
+    }
+    b->integrator = sum;
+
+    // drop what was read, the tail still holds parts of future impulses
+    memmove(b->buf, b->buf + count, (used - count) * sizeof(int32_t));
+    memset(b->buf + used - count, 0, count * sizeof(int32_t));
+    b->offset -= (uint64_t)count << BLIP_FRAC_BITS;
+    return count;
+}
@@ -1,4 +1,5 @@
 #include "nesmu.h"
+#include <inttypes.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
@@ -19,34 +20,31 @@
 #define VFLAG 0b01000000
 #define NFLAG 0b10000000
 
+// N and Z are evaluated lazily: cpu->nz holds the last result, Z is set
+// when its low byte is zero and N when bit 7 or bit 8 is. Bit 8 lets PLP
+// and RTI restore N and Z both set. P is only rebuilt from it when pushed
+// or traced, see cpu_get_p().
+
 #define IS_CFLAG (cpu->P & CFLAG)
-#define IS_ZFLAG (cpu->P & ZFLAG)
+#define IS_ZFLAG (!(cpu->nz & 0xff))
 #define IS_IFLAG (cpu->P & IFLAG)
 #define IS_DFLAG (cpu->P & DFLAG)
 #define IS_VFLAG (cpu->P & VFLAG)
-#define IS_NFLAG (cpu->P & NFLAG)
+#define IS_NFLAG (cpu->nz & 0x180)
 
 #define SET_CFLAG (cpu->P |= CFLAG)
-#define SET_ZFLAG (cpu->P |= ZFLAG)
 #define SET_IFLAG (cpu->P |= IFLAG)
 #define SET_DFLAG (cpu->P |= DFLAG)
 #define SET_VFLAG (cpu->P |= VFLAG)
-#define SET_NFLAG (cpu->P |= NFLAG)
 
 #define CLEAR_CFLAG (cpu->P &= ~CFLAG)
-#define CLEAR_ZFLAG (cpu->P &= ~ZFLAG)
 #define CLEAR_IFLAG (cpu->P &= ~IFLAG)
 #define CLEAR_DFLAG (cpu->P &= ~DFLAG)
 #define CLEAR_VFLAG (cpu->P &= ~VFLAG)
-#define CLEAR_NFLAG (cpu->P &= ~NFLAG)
 
-#define UPDATE_ZFLAG(VALUE) ((VALUE) == 0) ? SET_ZFLAG : CLEAR_ZFLAG
 #define UPDATE_VFLAG(VALUE) ((VALUE) & VFLAG) ? SET_VFLAG : CLEAR_VFLAG
-#define UPDATE_NFLAG(VALUE) ((VALUE) & NFLAG) ? SET_NFLAG : CLEAR_NFLAG
 
-#define UPDATE_ZNFLAGS(VALUE)                                                  \
-    UPDATE_ZFLAG(VALUE);                                                       \
-    UPDATE_NFLAG(VALUE)
+#define UPDATE_ZNFLAGS(VALUE) (cpu->nz = (uint8_t)(VALUE))
 
 // assuming PC is at beginning of current instruction
 
@@ -55,8 +53,33 @@ bool cpu_is_iflag(t_nes *nes) {
     return IS_IFLAG;
 }
 
+uint8_t cpu_get_p(t_cpu *cpu) {
+    uint8_t p = cpu->P & ~(NFLAG | ZFLAG);
+    p |= (IS_NFLAG) ? NFLAG : 0;
+    p |= (IS_ZFLAG) ? ZFLAG : 0;
+    return p;
+}
+
+void cpu_set_p(t_cpu *cpu, uint8_t p) {
+    cpu->P = p;
+    cpu->nz = ((p & NFLAG) << 1) | ((p & ZFLAG) ? 0 : 1);
+}
+
+static inline uint8_t bus_read(t_cpu *cpu, uint16_t addr) {
+    uint8_t *page = cpu->read_map[addr >> 8];
+    return page ? page[addr & 255] : cpu->read(cpu->userdata, addr);
+}
+
+static inline void bus_write(t_cpu *cpu, uint16_t addr, uint8_t val) {
+    uint8_t *page = cpu->write_map[addr >> 8];
+    if (page)
+        page[addr & 255] = val;
+    else
+        cpu->write(cpu->userdata, addr, val);
+}
+
 static inline uint8_t read(t_cpu *cpu, uint16_t addr) {
-    uint8_t val = cpu->read(cpu->userdata, addr);
+    uint8_t val = bus_read(cpu, addr);
     cpu->last_read = val;
     return val;
 }
@@ -66,7 +89,7 @@ static inline uint16_t read16(t_cpu *cpu, uint16_t addr) {
 }
 
 static inline void write(t_cpu *cpu, uint16_t addr, uint8_t val) {
-    return cpu->write(cpu->userdata, addr, val);
+    bus_write(cpu, addr, val);
 }
 
 static inline uint8_t read_immediate_lo(t_cpu *cpu) {
@@ -99,8 +122,8 @@ static inline uint16_t address_absolute_y(t_cpu *cpu) {
 
 static inline uint16_t indirection(t_cpu *cpu, uint16_t addr_lo,
                                    uint16_t addr_hi) {
-    uint8_t lo = cpu->read(cpu->userdata, addr_lo);
-    uint8_t hi = cpu->read(cpu->userdata, addr_hi);
+    uint8_t lo = bus_read(cpu, addr_lo);
+    uint8_t hi = bus_read(cpu, addr_hi);
     cpu->last_read = hi;
     return (hi << 8) | lo;
 }
@@ -137,13 +160,13 @@ static inline uint16_t address_relative(t_cpu *cpu) {
 static void stack_push(t_cpu *cpu, uint8_t val) {
     cpu->u16 = cpu->S + 0x100;
     cpu->S--;
-    cpu->write(cpu->userdata, cpu->u16, val);
+    bus_write(cpu, cpu->u16, val);
 }
 
 static uint8_t stack_pop(t_cpu *cpu) {
     cpu->S++;
     cpu->u16 = cpu->S + 0x100;
-    return cpu->read(cpu->userdata, cpu->u16);
+    return bus_read(cpu, cpu->u16);
 }
 
 static void stack_push16(t_cpu *cpu, uint16_t val) {
@@ -155,311 +178,286 @@ static uint16_t stack_pop16(t_cpu *cpu) {
     return stack_pop(cpu) + 256 * stack_pop(cpu);
 }
 
-#define READ_ACCUMULATOR cpu->A
-#define WRITE_ACCUMULATOR(VALUE) cpu->A = VALUE
-#define READ_REGISTER_X cpu->X
-#define WRITE_REGISTER_X(VALUE) cpu->X = VALUE
-#define READ_REGISTER_Y cpu->Y
-#define WRITE_REGISTER_Y(VALUE) cpu->Y = VALUE
-
-// #define ADDR_IMMEDIATE_LO cpu->PC + 1
-#define READ_IMMEDIATE_LO read_immediate_lo(cpu)
-
-#define ADDR_ZERO_PAGE READ_IMMEDIATE_LO
-#define READ_ZERO_PAGE read(cpu, ADDR_ZERO_PAGE)
-
-#define READ_ZERO_PAGE_LO read(cpu, ADDR_ZERO_PAGE)
-#define READ_ZERO_PAGE_HI read(cpu, (ADDR_ZERO_PAGE + 1) & 255)
-#define ADDR_ZERO_PAGE_INDIRECT_WRAPPED                                        \
-    ((READ_ZERO_PAGE_LO) + (256 * (READ_ZERO_PAGE_HI)))
+// addressing modes: each resolves the effective address exactly once,
+// immediate operands are addressed in place at PC + 1
 
-#define WRITE_ZERO_PAGE(VALUE) write(cpu, ADDR_ZERO_PAGE, VALUE)
-#define ADDR_ZERO_PAGE_X (READ_IMMEDIATE_LO + cpu->X) & 255
-#define ADDR_ZERO_PAGE_X_LO ADDR_ZERO_PAGE_X
-#define ADDR_ZERO_PAGE_X_HI (READ_IMMEDIATE_LO + cpu->X + 1) & 255
-
-#define READ_ZERO_PAGE_X_LO read(cpu, ADDR_ZERO_PAGE_X_LO)
-#define READ_ZERO_PAGE_X READ_ZERO_PAGE_X_LO
-#define READ_ZERO_PAGE_X_HI read(cpu, ADDR_ZERO_PAGE_X_HI)
-
-#define WRITE_ZERO_PAGE_X(VALUE) write(cpu, ADDR_ZERO_PAGE_X, VALUE)
-#define ADDR_ZERO_PAGE_Y (READ_IMMEDIATE_LO + cpu->Y) & 255
-#define READ_ZERO_PAGE_Y read(cpu, ADDR_ZERO_PAGE_Y)
-#define WRITE_ZERO_PAGE_Y(VALUE) write(cpu, ADDR_ZERO_PAGE_Y, VALUE)
-#define ADDR_RELATIVE cpu->PC + (int16_t)(int8_t)READ_IMMEDIATE_LO
-#define READ_RELATIVE read(ADDR_RELATIVE)
+static inline uint16_t mode_imm(t_cpu *cpu) { return cpu->PC + 1; }
+static inline uint16_t mode_zpg(t_cpu *cpu) { return read_immediate_lo(cpu); }
+static inline uint16_t mode_zpx(t_cpu *cpu) {
+    return (read_immediate_lo(cpu) + cpu->X) & 255;
+}
+static inline uint16_t mode_zpy(t_cpu *cpu) {
+    return (read_immediate_lo(cpu) + cpu->Y) & 255;
+}
+static inline uint16_t mode_abs(t_cpu *cpu) { return address_absolute(cpu); }
+static inline uint16_t mode_abx(t_cpu *cpu) { return address_absolute_x(cpu); }
+static inline uint16_t mode_aby(t_cpu *cpu) { return address_absolute_y(cpu); }
+static inline uint16_t mode_idx(t_cpu *cpu) { return address_indirect_x(cpu); }
+static inline uint16_t mode_idy(t_cpu *cpu) { return address_indirect_y(cpu); }
 
 #define ADDR_ABSOLUTE address_absolute(cpu)
-#define READ_ABSOLUTE read(cpu, ADDR_ABSOLUTE)
-#define WRITE_ABSOLUTE(VALUE) write(cpu, ADDR_ABSOLUTE, VALUE)
-
-#define ADDR_ABSOLUTE_X address_absolute_x(cpu)
-#define READ_ABSOLUTE_X read(cpu, ADDR_ABSOLUTE_X)
-#define WRITE_ABSOLUTE_X(VALUE) write(cpu, ADDR_ABSOLUTE_X, VALUE)
-
-#define ADDR_ABSOLUTE_Y address_absolute_y(cpu)
-#define READ_ABSOLUTE_Y read(cpu, ADDR_ABSOLUTE_Y)
-#define WRITE_ABSOLUTE_Y(VALUE) write(cpu, ADDR_ABSOLUTE_Y, VALUE)
-
 #define ADDR_INDIRECT address_indirect(cpu)
-#define READ_INDIRECT read(cpu, ADDR_INDIRECT)
 
-#define ADDR_INDIRECT_X address_indirect_x(cpu)
-#define READ_INDIRECT_X read(cpu, ADDR_INDIRECT_X)
-#define WRITE_INDIRECT_X(VALUE) write(cpu, ADDR_INDIRECT_X, VALUE)
+// every (operation, addressing mode) handler comes from this template
+#define OP_FN(NAME, OP, MODE)                                                  \
+    void NAME(t_cpu *cpu) { OP(cpu, MODE(cpu)); }
 
-#define ADDR_INDIRECT_Y address_indirect_y(cpu)
-#define READ_INDIRECT_Y read(cpu, ADDR_INDIRECT_Y)
-#define WRITE_INDIRECT_Y(VALUE) write(cpu, ADDR_INDIRECT_Y, VALUE)
+// operations on a register and a byte in memory
 
-#define LOAD_FN(NAME, DST, MACRO)                                              \
-    void NAME(t_cpu *cpu) {                                                    \
-        DST = MACRO;                                                           \
+#define LOAD_OP(NAME, DST)                                                     \
+    static inline void NAME(t_cpu *cpu, uint16_t addr) {                       \
+        DST = read(cpu, addr);                                                 \
         UPDATE_ZNFLAGS(DST);                                                   \
     }
-LOAD_FN(lda_imm, cpu->A, READ_IMMEDIATE_LO) // 0xa9
-LOAD_FN(lda_zpg, cpu->A, READ_ZERO_PAGE)    // 0xa5
-LOAD_FN(lda_zpx, cpu->A, READ_ZERO_PAGE_X)  // 0xb5
-LOAD_FN(lda_abs, cpu->A, READ_ABSOLUTE)     // 0xad
-LOAD_FN(lda_abx, cpu->A, READ_ABSOLUTE_X)   // 0xbd
-LOAD_FN(lda_aby, cpu->A, READ_ABSOLUTE_Y)   // 0xb9
-LOAD_FN(lda_idx, cpu->A, READ_INDIRECT_X)   // 0xa1
-LOAD_FN(lda_idy, cpu->A, READ_INDIRECT_Y)   // 0xb1
-LOAD_FN(ldx_imm, cpu->X, READ_IMMEDIATE_LO) // 0xa2
-LOAD_FN(ldx_zpg, cpu->X, READ_ZERO_PAGE)    // 0xa6
-LOAD_FN(ldx_zpy, cpu->X, READ_ZERO_PAGE_Y)  // 0xb6
-LOAD_FN(ldx_abs, cpu->X, READ_ABSOLUTE)     // 0xae
-LOAD_FN(ldx_aby, cpu->X, READ_ABSOLUTE_Y)   // 0xbe
-LOAD_FN(ldy_imm, cpu->Y, READ_IMMEDIATE_LO) // 0xa0
-LOAD_FN(ldy_zpg, cpu->Y, READ_ZERO_PAGE)    // 0xa4
-LOAD_FN(ldy_zpx, cpu->Y, READ_ZERO_PAGE_X)  // 0xb4
-LOAD_FN(ldy_abs, cpu->Y, READ_ABSOLUTE)     // 0xac
-LOAD_FN(ldy_abx, cpu->Y, READ_ABSOLUTE_X)   // 0xbc
-
-#define STORE_FN(NAME, SRC, MACRO)                                             \
-    void NAME(t_cpu *cpu) { MACRO(SRC); }
-STORE_FN(sta_zpg, cpu->A, WRITE_ZERO_PAGE)   // 0x85
-STORE_FN(sta_zpx, cpu->A, WRITE_ZERO_PAGE_X) // 0x95
-STORE_FN(sta_abs, cpu->A, WRITE_ABSOLUTE)    // 0x8d
-STORE_FN(sta_abx, cpu->A, WRITE_ABSOLUTE_X)  // 0x9d
-STORE_FN(sta_aby, cpu->A, WRITE_ABSOLUTE_Y)  // 0x99
-STORE_FN(sta_idx, cpu->A, WRITE_INDIRECT_X)  // 0x81
-STORE_FN(sta_idy, cpu->A, WRITE_INDIRECT_Y)  // 0x91
-STORE_FN(stx_zpg, cpu->X, WRITE_ZERO_PAGE)   // 0x86
-STORE_FN(stx_zpy, cpu->X, WRITE_ZERO_PAGE_Y) // 0x96
-STORE_FN(stx_abs, cpu->X, WRITE_ABSOLUTE)    // 0x8e
-STORE_FN(sty_zpg, cpu->Y, WRITE_ZERO_PAGE)   // 0x84
-STORE_FN(sty_zpx, cpu->Y, WRITE_ZERO_PAGE_X) // 0x94
-STORE_FN(sty_abs, cpu->Y, WRITE_ABSOLUTE)    // 0x8c
-
-#define AND_FN(NAME, MACRO)                                                    \
-    void NAME(t_cpu *cpu) {                                                    \
-        cpu->A &= MACRO;                                                       \
-        UPDATE_ZNFLAGS(cpu->A);                                                \
-    }
-AND_FN(and_imm, READ_IMMEDIATE_LO) // 0x29
-AND_FN(and_zpg, READ_ZERO_PAGE)    // 0x25
-AND_FN(and_zpx, READ_ZERO_PAGE_X)  // 0x35
-AND_FN(and_abs, READ_ABSOLUTE)     // 0x2d
-AND_FN(and_abx, READ_ABSOLUTE_X)   // 0x3d
-AND_FN(and_aby, READ_ABSOLUTE_Y)   // 0x39
-AND_FN(and_idx, READ_INDIRECT_X)   // 0x21
-AND_FN(and_idy, READ_INDIRECT_Y)   // 0x31
-
-#define EOR_FN(NAME, MACRO)                                                    \
-    void NAME(t_cpu *cpu) {                                                    \
-        cpu->A ^= MACRO;                                                       \
-        UPDATE_ZNFLAGS(cpu->A);                                                \
+LOAD_OP(op_lda, cpu->A)
+LOAD_OP(op_ldx, cpu->X)
+LOAD_OP(op_ldy, cpu->Y)
+
+#define STORE_OP(NAME, SRC)                                                    \
+    static inline void NAME(t_cpu *cpu, uint16_t addr) {                       \
+        write(cpu, addr, SRC);                                                 \
     }
-EOR_FN(eor_imm, READ_IMMEDIATE_LO) // 0x49
-EOR_FN(eor_zpg, READ_ZERO_PAGE)    // 0x45
-EOR_FN(eor_zpx, READ_ZERO_PAGE_X)  // 0x55
-EOR_FN(eor_abs, READ_ABSOLUTE)     // 0x4d
-EOR_FN(eor_abx, READ_ABSOLUTE_X)   // 0x5d
-EOR_FN(eor_aby, READ_ABSOLUTE_Y)   // 0x59
-EOR_FN(eor_idx, READ_INDIRECT_X)   // 0x41
-EOR_FN(eor_idy, READ_INDIRECT_Y)   // 0x51
-
-#define ORA_FN(NAME, MACRO)                                                    \
-    void NAME(t_cpu *cpu) {                                                    \
-        cpu->A |= MACRO;                                                       \
+STORE_OP(op_sta, cpu->A)
+STORE_OP(op_stx, cpu->X)
+STORE_OP(op_sty, cpu->Y)
+
+#define LOGIC_OP(NAME, OPERATOR)                                               \
+    static inline void NAME(t_cpu *cpu, uint16_t addr) {                       \
+        cpu->A OPERATOR read(cpu, addr);                                       \
         UPDATE_ZNFLAGS(cpu->A);                                                \
     }
-ORA_FN(ora_imm, READ_IMMEDIATE_LO) // 0x09
-ORA_FN(ora_zpg, READ_ZERO_PAGE)    // 0x05
-ORA_FN(ora_zpx, READ_ZERO_PAGE_X)  // 0x15
-ORA_FN(ora_abs, READ_ABSOLUTE)     // 0x0d
-ORA_FN(ora_abx, READ_ABSOLUTE_X)   // 0x1d
-ORA_FN(ora_aby, READ_ABSOLUTE_Y)   // 0x19
-ORA_FN(ora_idx, READ_INDIRECT_X)   // 0x01
-ORA_FN(ora_idy, READ_INDIRECT_Y)   // 0x11
-
-#define BIT_FN(NAME, MACRO)                                                    \
-    void NAME(t_cpu *cpu) {                                                    \
-        cpu->u8 = MACRO;                                                       \
-        cpu->u8 & cpu->A ? CLEAR_ZFLAG : SET_ZFLAG;                            \
-        UPDATE_VFLAG(cpu->u8);                                                 \
-        UPDATE_NFLAG(cpu->u8);                                                 \
-    }
-
-BIT_FN(bit_zpg, READ_ZERO_PAGE) // 0x24
-BIT_FN(bit_abs, READ_ABSOLUTE)  // 0x2c
+LOGIC_OP(op_and, &=)
+LOGIC_OP(op_eor, ^=)
+LOGIC_OP(op_ora, |=)
+
+static inline void op_bit(t_cpu *cpu, uint16_t addr) {
+    cpu->u8 = read(cpu, addr);
+    UPDATE_VFLAG(cpu->u8);
+    cpu->nz = (cpu->u8 & cpu->A) | ((cpu->u8 & NFLAG) << 1);
+}
 
-#define COMPARE_FN(NAME, REGISTER, MACRO)                                      \
-    void NAME(t_cpu *cpu) {                                                    \
-        cpu->u8 = MACRO;                                                       \
+#define COMPARE_OP(NAME, REGISTER)                                             \
+    static inline void NAME(t_cpu *cpu, uint16_t addr) {                       \
+        cpu->u8 = read(cpu, addr);                                             \
         (REGISTER < cpu->u8) ? CLEAR_CFLAG : SET_CFLAG;                        \
         cpu->u8 = REGISTER - cpu->u8;                                          \
         UPDATE_ZNFLAGS(cpu->u8);                                               \
     }
-
-COMPARE_FN(cmp_imm, cpu->A, READ_IMMEDIATE_LO) // 0xc9
-COMPARE_FN(cmp_zpg, cpu->A, READ_ZERO_PAGE)    // 0xc5
-COMPARE_FN(cmp_zpx, cpu->A, READ_ZERO_PAGE_X)  // 0xd5
-COMPARE_FN(cmp_abs, cpu->A, READ_ABSOLUTE)     // 0xcd
-COMPARE_FN(cmp_abx, cpu->A, READ_ABSOLUTE_X)   // 0xdd
-COMPARE_FN(cmp_aby, cpu->A, READ_ABSOLUTE_Y)   // 0xd9
-COMPARE_FN(cmp_idx, cpu->A, READ_INDIRECT_X)   // 0xc1
-COMPARE_FN(cmp_idy, cpu->A, READ_INDIRECT_Y)   // 0xd1
-COMPARE_FN(cpx_imm, cpu->X, READ_IMMEDIATE_LO) // 0xe0
-COMPARE_FN(cpx_zpg, cpu->X, READ_ZERO_PAGE)    // 0xe4
-COMPARE_FN(cpx_abs, cpu->X, READ_ABSOLUTE)     // 0xec
-COMPARE_FN(cpy_imm, cpu->Y, READ_IMMEDIATE_LO) // 0xc0
-COMPARE_FN(cpy_zpg, cpu->Y, READ_ZERO_PAGE)    // 0xc4
-COMPARE_FN(cpy_abs, cpu->Y, READ_ABSOLUTE)     // 0xcc
+COMPARE_OP(op_cmp, cpu->A)
+COMPARE_OP(op_cpx, cpu->X)
+COMPARE_OP(op_cpy, cpu->Y)
 
 // https://stackoverflow.com/a/29224684
 #define IS_ADC_OVERFLOW (~(cpu->A ^ cpu->u8) & (cpu->A ^ cpu->u16) & 0x80)
-#define ADDCARRY_FN(NAME, MACRO)                                               \
-    void NAME(t_cpu *cpu) {                                                    \
-        cpu->u8 = MACRO;                                                       \
-        cpu->u16 = cpu->A + cpu->u8 + (IS_CFLAG);                              \
-        cpu->u16 > 255 ? SET_CFLAG : CLEAR_CFLAG;                              \
-        IS_ADC_OVERFLOW ? SET_VFLAG : CLEAR_VFLAG;                             \
-        cpu->A = cpu->u16;                                                     \
-        UPDATE_ZNFLAGS(cpu->A);                                                \
-    }
-
-ADDCARRY_FN(adc_imm, READ_IMMEDIATE_LO) // 0x69
-ADDCARRY_FN(adc_zpg, READ_ZERO_PAGE)    // 0x65
-ADDCARRY_FN(adc_zpx, READ_ZERO_PAGE_X)  // 0x75
-ADDCARRY_FN(adc_abs, READ_ABSOLUTE)     // 0x6d
-ADDCARRY_FN(adc_abx, READ_ABSOLUTE_X)   // 0x7d
-ADDCARRY_FN(adc_aby, READ_ABSOLUTE_Y)   // 0x79
-ADDCARRY_FN(adc_idx, READ_INDIRECT_X)   // 0x61
-ADDCARRY_FN(adc_idy, READ_INDIRECT_Y)   // 0x71
-
-#define SUBCARRY_FN(NAME, MACRO)                                               \
-    void NAME(t_cpu *cpu) {                                                    \
-        cpu->u8 = 255 ^ MACRO;                                                 \
-        cpu->u16 = cpu->A + cpu->u8 + (IS_CFLAG);                              \
-        cpu->u16 > 255 ? SET_CFLAG : CLEAR_CFLAG;                              \
-        IS_ADC_OVERFLOW ? SET_VFLAG : CLEAR_VFLAG;                             \
-        cpu->A = cpu->u16;                                                     \
-        UPDATE_ZNFLAGS(cpu->A);                                                \
-    }
-
-SUBCARRY_FN(sbc_imm, READ_IMMEDIATE_LO) // 0xe9
-SUBCARRY_FN(sbc_zpg, READ_ZERO_PAGE)    // 0xe5
-SUBCARRY_FN(sbc_zpx, READ_ZERO_PAGE_X)  // 0xf5
-SUBCARRY_FN(sbc_abs, READ_ABSOLUTE)     // 0xed
-SUBCARRY_FN(sbc_abx, READ_ABSOLUTE_X)   // 0xfd
-SUBCARRY_FN(sbc_aby, READ_ABSOLUTE_Y)   // 0xf9
-SUBCARRY_FN(sbc_idx, READ_INDIRECT_X)   // 0xe1
-SUBCARRY_FN(sbc_idy, READ_INDIRECT_Y)   // 0xf1
-
-#define ASL_FN(NAME, READ, WRITE)                                              \
-    void NAME(t_cpu *cpu) {                                                    \
-        cpu->u8 = READ;                                                        \
-        cpu->u8 & 128 ? SET_CFLAG : CLEAR_CFLAG;                               \
-        cpu->u8 <<= 1;                                                         \
-        UPDATE_ZNFLAGS(cpu->u8);                                               \
-        WRITE(cpu->u8);                                                        \
-    }
+static inline void add_with_carry(t_cpu *cpu, uint8_t val) {
+    cpu->u8 = val;
+    cpu->u16 = cpu->A + cpu->u8 + (IS_CFLAG);
+    cpu->u16 > 255 ? SET_CFLAG : CLEAR_CFLAG;
+    IS_ADC_OVERFLOW ? SET_VFLAG : CLEAR_VFLAG;
+    cpu->A = cpu->u16;
+    UPDATE_ZNFLAGS(cpu->A);
+}
 
-ASL_FN(asl_acc, READ_ACCUMULATOR, WRITE_ACCUMULATOR) // 0x0a
-ASL_FN(asl_zpg, READ_ZERO_PAGE, WRITE_ZERO_PAGE)     // 0x06
-ASL_FN(asl_zpx, READ_ZERO_PAGE_X, WRITE_ZERO_PAGE_X) // 0x16
-ASL_FN(asl_abs, READ_ABSOLUTE, WRITE_ABSOLUTE)       // 0x0e
-ASL_FN(asl_abx, READ_ABSOLUTE_X, WRITE_ABSOLUTE_X)   // 0x1e
+static inline void op_adc(t_cpu *cpu, uint16_t addr) {
+    add_with_carry(cpu, read(cpu, addr));
+}
 
-#define LSR_FN(NAME, READ, WRITE)                                              \
-    void NAME(t_cpu *cpu) {                                                    \
-        cpu->u8 = READ;                                                        \
-        cpu->u8 & 1 ? SET_CFLAG : CLEAR_CFLAG;                                 \
-        cpu->u8 >>= 1;                                                         \
-        UPDATE_ZNFLAGS(cpu->u8);                                               \
-        WRITE(cpu->u8);                                                        \
-    }
+static inline void op_sbc(t_cpu *cpu, uint16_t addr) {
+    add_with_carry(cpu, 255 ^ read(cpu, addr));
+}
 
-LSR_FN(lsr_acc, READ_ACCUMULATOR, WRITE_ACCUMULATOR) // 0x4a
-LSR_FN(lsr_zpg, READ_ZERO_PAGE, WRITE_ZERO_PAGE)     // 0x46
-LSR_FN(lsr_zpx, READ_ZERO_PAGE_X, WRITE_ZERO_PAGE_X) // 0x56
-LSR_FN(lsr_abs, READ_ABSOLUTE, WRITE_ABSOLUTE)       // 0x4e
-LSR_FN(lsr_abx, READ_ABSOLUTE_X, WRITE_ABSOLUTE_X)   // 0x5e
+// read-modify-write operations, shared by the accumulator, register
+// and memory forms
 
-#define ROL_FN(NAME, READ, WRITE)                                              \
-    void NAME(t_cpu *cpu) {                                                    \
-        cpu->u16 = READ;                                                       \
-        cpu->u16 = (cpu->u16 << 1) | (IS_CFLAG);                               \
-        cpu->u16 & 256 ? SET_CFLAG : CLEAR_CFLAG;                              \
-        cpu->u8 = cpu->u16;                                                    \
-        UPDATE_ZNFLAGS(cpu->u8);                                               \
-        WRITE(cpu->u8);                                                        \
-    }
+static inline uint8_t asl_value(t_cpu *cpu, uint8_t val) {
+    val & 128 ? SET_CFLAG : CLEAR_CFLAG;
+    val <<= 1;
+    UPDATE_ZNFLAGS(val);
+    return val;
+}
 
-ROL_FN(rol_acc, READ_ACCUMULATOR, WRITE_ACCUMULATOR) // 0x2a
-ROL_FN(rol_zpg, READ_ZERO_PAGE, WRITE_ZERO_PAGE)     // 0x26
-ROL_FN(rol_zpx, READ_ZERO_PAGE_X, WRITE_ZERO_PAGE_X) // 0x36
-ROL_FN(rol_abs, READ_ABSOLUTE, WRITE_ABSOLUTE)       // 0x2e
-ROL_FN(rol_abx, READ_ABSOLUTE_X, WRITE_ABSOLUTE_X)   // 0x3e
+static inline uint8_t lsr_value(t_cpu *cpu, uint8_t val) {
+    val & 1 ? SET_CFLAG : CLEAR_CFLAG;
+    val >>= 1;
+    UPDATE_ZNFLAGS(val);
+    return val;
+}
 
-#define ROR_FN(NAME, READ, WRITE)                                              \
-    void NAME(t_cpu *cpu) {                                                    \
-        cpu->u16 = READ;                                                       \
-        cpu->u16 |= (IS_CFLAG) << 8;                                           \
-        cpu->u16 & 1 ? SET_CFLAG : CLEAR_CFLAG;                                \
-        cpu->u16 >>= 1;                                                        \
-        cpu->u8 = cpu->u16;                                                    \
-        UPDATE_ZNFLAGS(cpu->u8);                                               \
-        WRITE(cpu->u8);                                                        \
-    }
+static inline uint8_t rol_value(t_cpu *cpu, uint8_t val) {
+    cpu->u16 = (val << 1) | (IS_CFLAG);
+    cpu->u16 & 256 ? SET_CFLAG : CLEAR_CFLAG;
+    val = cpu->u16;
+    UPDATE_ZNFLAGS(val);
+    return val;
+}
 
-ROR_FN(ror_acc, READ_ACCUMULATOR, WRITE_ACCUMULATOR) // 0x6a
-ROR_FN(ror_zpg, READ_ZERO_PAGE, WRITE_ZERO_PAGE)     // 0x66
-ROR_FN(ror_zpx, READ_ZERO_PAGE_X, WRITE_ZERO_PAGE_X) // 0x76
-ROR_FN(ror_abs, READ_ABSOLUTE, WRITE_ABSOLUTE)       // 0x6e
-ROR_FN(ror_abx, READ_ABSOLUTE_X, WRITE_ABSOLUTE_X)   // 0x7e
+static inline uint8_t ror_value(t_cpu *cpu, uint8_t val) {
+    cpu->u16 = val | ((IS_CFLAG) << 8);
+    cpu->u16 & 1 ? SET_CFLAG : CLEAR_CFLAG;
+    val = cpu->u16 >> 1;
+    UPDATE_ZNFLAGS(val);
+    return val;
+}
 
-#define DECREMENT_FN(NAME, READ, WRITE)                                        \
-    void NAME(t_cpu *cpu) {                                                    \
-        cpu->u8 = READ;                                                        \
-        cpu->u8 -= 1;                                                          \
-        UPDATE_ZNFLAGS(cpu->u8);                                               \
-        WRITE(cpu->u8);                                                        \
-    }
+static inline uint8_t dec_value(t_cpu *cpu, uint8_t val) {
+    val -= 1;
+    UPDATE_ZNFLAGS(val);
+    return val;
+}
 
-DECREMENT_FN(dec_zpg, READ_ZERO_PAGE, WRITE_ZERO_PAGE)     // 0xc6
-DECREMENT_FN(dec_zpx, READ_ZERO_PAGE_X, WRITE_ZERO_PAGE_X) // 0xd6
-DECREMENT_FN(dec_abs, READ_ABSOLUTE, WRITE_ABSOLUTE)       // 0xce
-DECREMENT_FN(dec_abx, READ_ABSOLUTE_X, WRITE_ABSOLUTE_X)   // 0xde
-DECREMENT_FN(dex_imp, READ_REGISTER_X, WRITE_REGISTER_X)   // 0xca
-DECREMENT_FN(dey_imp, READ_REGISTER_Y, WRITE_REGISTER_Y)   // 0x88
+static inline uint8_t inc_value(t_cpu *cpu, uint8_t val) {
+    val += 1;
+    UPDATE_ZNFLAGS(val);
+    return val;
+}
 
-#define INCREMENT_FN(NAME, READ, WRITE)                                        \
-    void NAME(t_cpu *cpu) {                                                    \
-        cpu->u8 = READ;                                                        \
-        cpu->u8 += 1;                                                          \
-        UPDATE_ZNFLAGS(cpu->u8);                                               \
-        WRITE(cpu->u8);                                                        \
+#define RMW_OP(NAME, FN)                                                       \
+    static inline void NAME(t_cpu *cpu, uint16_t addr) {                       \
+        write(cpu, addr, FN(cpu, read(cpu, addr)));                            \
     }
-
-INCREMENT_FN(inc_zpg, READ_ZERO_PAGE, WRITE_ZERO_PAGE)     // 0xe6
-INCREMENT_FN(inc_zpx, READ_ZERO_PAGE_X, WRITE_ZERO_PAGE_X) // 0xf6
-INCREMENT_FN(inc_abs, READ_ABSOLUTE, WRITE_ABSOLUTE)       // 0xee
-INCREMENT_FN(inc_abx, READ_ABSOLUTE_X, WRITE_ABSOLUTE_X)   // 0xfe
-INCREMENT_FN(inx_imp, READ_REGISTER_X, WRITE_REGISTER_X)   // 0xe8
-INCREMENT_FN(iny_imp, READ_REGISTER_Y, WRITE_REGISTER_Y)   // 0xc8
+RMW_OP(op_asl, asl_value)
+RMW_OP(op_lsr, lsr_value)
+RMW_OP(op_rol, rol_value)
+RMW_OP(op_ror, ror_value)
+RMW_OP(op_dec, dec_value)
+RMW_OP(op_inc, inc_value)
+
+#define REGISTER_FN(NAME, FN, REGISTER)                                        \
+    void NAME(t_cpu *cpu) { REGISTER = FN(cpu, REGISTER); }
+
+OP_FN(lda_imm, op_lda, mode_imm) // 0xa9
+OP_FN(lda_zpg, op_lda, mode_zpg) // 0xa5
+OP_FN(lda_zpx, op_lda, mode_zpx) // 0xb5
+OP_FN(lda_abs, op_lda, mode_abs) // 0xad
+OP_FN(lda_abx, op_lda, mode_abx) // 0xbd
+OP_FN(lda_aby, op_lda, mode_aby) // 0xb9
+OP_FN(lda_idx, op_lda, mode_idx) // 0xa1
+OP_FN(lda_idy, op_lda, mode_idy) // 0xb1
+OP_FN(ldx_imm, op_ldx, mode_imm) // 0xa2
+OP_FN(ldx_zpg, op_ldx, mode_zpg) // 0xa6
+OP_FN(ldx_zpy, op_ldx, mode_zpy) // 0xb6
+OP_FN(ldx_abs, op_ldx, mode_abs) // 0xae
+OP_FN(ldx_aby, op_ldx, mode_aby) // 0xbe
+OP_FN(ldy_imm, op_ldy, mode_imm) // 0xa0
+OP_FN(ldy_zpg, op_ldy, mode_zpg) // 0xa4
+OP_FN(ldy_zpx, op_ldy, mode_zpx) // 0xb4
+OP_FN(ldy_abs, op_ldy, mode_abs) // 0xac
+OP_FN(ldy_abx, op_ldy, mode_abx) // 0xbc
+
+OP_FN(sta_zpg, op_sta, mode_zpg) // 0x85
+OP_FN(sta_zpx, op_sta, mode_zpx) // 0x95
+OP_FN(sta_abs, op_sta, mode_abs) // 0x8d
+OP_FN(sta_abx, op_sta, mode_abx) // 0x9d
+OP_FN(sta_aby, op_sta, mode_aby) // 0x99
+OP_FN(sta_idx, op_sta, mode_idx) // 0x81
+OP_FN(sta_idy, op_sta, mode_idy) // 0x91
+OP_FN(stx_zpg, op_stx, mode_zpg) // 0x86
+OP_FN(stx_zpy, op_stx, mode_zpy) // 0x96
+OP_FN(stx_abs, op_stx, mode_abs) // 0x8e
+OP_FN(sty_zpg, op_sty, mode_zpg) // 0x84
+OP_FN(sty_zpx, op_sty, mode_zpx) // 0x94
+OP_FN(sty_abs, op_sty, mode_abs) // 0x8c
+
+OP_FN(and_imm, op_and, mode_imm) // 0x29
+OP_FN(and_zpg, op_and, mode_zpg) // 0x25
+OP_FN(and_zpx, op_and, mode_zpx) // 0x35
+OP_FN(and_abs, op_and, mode_abs) // 0x2d
+OP_FN(and_abx, op_and, mode_abx) // 0x3d
+OP_FN(and_aby, op_and, mode_aby) // 0x39
+OP_FN(and_idx, op_and, mode_idx) // 0x21
+OP_FN(and_idy, op_and, mode_idy) // 0x31
+
+OP_FN(eor_imm, op_eor, mode_imm) // 0x49
+OP_FN(eor_zpg, op_eor, mode_zpg) // 0x45
+OP_FN(eor_zpx, op_eor, mode_zpx) // 0x55
+OP_FN(eor_abs, op_eor, mode_abs) // 0x4d
+OP_FN(eor_abx, op_eor, mode_abx) // 0x5d
+OP_FN(eor_aby, op_eor, mode_aby) // 0x59
+OP_FN(eor_idx, op_eor, mode_idx) // 0x41
+OP_FN(eor_idy, op_eor, mode_idy) // 0x51
+
+OP_FN(ora_imm, op_ora, mode_imm) // 0x09
+OP_FN(ora_zpg, op_ora, mode_zpg) // 0x05
+OP_FN(ora_zpx, op_ora, mode_zpx) // 0x15
+OP_FN(ora_abs, op_ora, mode_abs) // 0x0d
+OP_FN(ora_abx, op_ora, mode_abx) // 0x1d
+OP_FN(ora_aby, op_ora, mode_aby) // 0x19
+OP_FN(ora_idx, op_ora, mode_idx) // 0x01
+OP_FN(ora_idy, op_ora, mode_idy) // 0x11
+
+OP_FN(bit_zpg, op_bit, mode_zpg) // 0x24
+OP_FN(bit_abs, op_bit, mode_abs) // 0x2c
+
+OP_FN(cmp_imm, op_cmp, mode_imm) // 0xc9
+OP_FN(cmp_zpg, op_cmp, mode_zpg) // 0xc5
+OP_FN(cmp_zpx, op_cmp, mode_zpx) // 0xd5
+OP_FN(cmp_abs, op_cmp, mode_abs) // 0xcd
+OP_FN(cmp_abx, op_cmp, mode_abx) // 0xdd
+OP_FN(cmp_aby, op_cmp, mode_aby) // 0xd9
+OP_FN(cmp_idx, op_cmp, mode_idx) // 0xc1
+OP_FN(cmp_idy, op_cmp, mode_idy) // 0xd1
+OP_FN(cpx_imm, op_cpx, mode_imm) // 0xe0
+OP_FN(cpx_zpg, op_cpx, mode_zpg) // 0xe4
+OP_FN(cpx_abs, op_cpx, mode_abs) // 0xec
+OP_FN(cpy_imm, op_cpy, mode_imm) // 0xc0
+OP_FN(cpy_zpg, op_cpy, mode_zpg) // 0xc4
+OP_FN(cpy_abs, op_cpy, mode_abs) // 0xcc
+
+OP_FN(adc_imm, op_adc, mode_imm) // 0x69
+OP_FN(adc_zpg, op_adc, mode_zpg) // 0x65
+OP_FN(adc_zpx, op_adc, mode_zpx) // 0x75
+OP_FN(adc_abs, op_adc, mode_abs) // 0x6d
+OP_FN(adc_abx, op_adc, mode_abx) // 0x7d
+OP_FN(adc_aby, op_adc, mode_aby) // 0x79
+OP_FN(adc_idx, op_adc, mode_idx) // 0x61
+OP_FN(adc_idy, op_adc, mode_idy) // 0x71
+
+OP_FN(sbc_imm, op_sbc, mode_imm) // 0xe9
+OP_FN(sbc_zpg, op_sbc, mode_zpg) // 0xe5
+OP_FN(sbc_zpx, op_sbc, mode_zpx) // 0xf5
+OP_FN(sbc_abs, op_sbc, mode_abs) // 0xed
+OP_FN(sbc_abx, op_sbc, mode_abx) // 0xfd
+OP_FN(sbc_aby, op_sbc, mode_aby) // 0xf9
+OP_FN(sbc_idx, op_sbc, mode_idx) // 0xe1
+OP_FN(sbc_idy, op_sbc, mode_idy) // 0xf1
+
+REGISTER_FN(asl_acc, asl_value, cpu->A) // 0x0a
+OP_FN(asl_zpg, op_asl, mode_zpg)        // 0x06
+OP_FN(asl_zpx, op_asl, mode_zpx)        // 0x16
+OP_FN(asl_abs, op_asl, mode_abs)        // 0x0e
+OP_FN(asl_abx, op_asl, mode_abx)        // 0x1e
+
+REGISTER_FN(lsr_acc, lsr_value, cpu->A) // 0x4a
+OP_FN(lsr_zpg, op_lsr, mode_zpg)        // 0x46
+OP_FN(lsr_zpx, op_lsr, mode_zpx)        // 0x56
+OP_FN(lsr_abs, op_lsr, mode_abs)        // 0x4e
+OP_FN(lsr_abx, op_lsr, mode_abx)        // 0x5e
+
+REGISTER_FN(rol_acc, rol_value, cpu->A) // 0x2a
+OP_FN(rol_zpg, op_rol, mode_zpg)        // 0x26
+OP_FN(rol_zpx, op_rol, mode_zpx)        // 0x36
+OP_FN(rol_abs, op_rol, mode_abs)        // 0x2e
+OP_FN(rol_abx, op_rol, mode_abx)        // 0x3e
+
+REGISTER_FN(ror_acc, ror_value, cpu->A) // 0x6a
+OP_FN(ror_zpg, op_ror, mode_zpg)        // 0x66
+OP_FN(ror_zpx, op_ror, mode_zpx)        // 0x76
+OP_FN(ror_abs, op_ror, mode_abs)        // 0x6e
+OP_FN(ror_abx, op_ror, mode_abx)        // 0x7e
+
+OP_FN(dec_zpg, op_dec, mode_zpg)        // 0xc6
+OP_FN(dec_zpx, op_dec, mode_zpx)        // 0xd6
+OP_FN(dec_abs, op_dec, mode_abs)        // 0xce
+OP_FN(dec_abx, op_dec, mode_abx)        // 0xde
+REGISTER_FN(dex_imp, dec_value, cpu->X) // 0xca
+REGISTER_FN(dey_imp, dec_value, cpu->Y) // 0x88
+
+OP_FN(inc_zpg, op_inc, mode_zpg)        // 0xe6
+OP_FN(inc_zpx, op_inc, mode_zpx)        // 0xf6
+OP_FN(inc_abs, op_inc, mode_abs)        // 0xee
+OP_FN(inc_abx, op_inc, mode_abx)        // 0xfe
+REGISTER_FN(inx_imp, inc_value, cpu->X) // 0xe8
+REGISTER_FN(iny_imp, inc_value, cpu->Y) // 0xc8
 
 void bcc_rel(t_cpu *cpu) {
     cpu->PC = (IS_CFLAG) ? cpu->PC : address_relative(cpu);
@@ -500,17 +498,31 @@ TRANSFER_FN(tya_imp, cpu->Y, cpu->A)          // 0x98
 
 void nop_imp(t_cpu *cpu) { (void)cpu; } // 0xea
 
+// a pending IRQ is taken on the next boundary once I is cleared
+static void irq_poll(t_cpu *cpu) {
+    if ((cpu->irq_line) && (!IS_IFLAG))
+        sched_set(cpu->userdata, EV_IRQ, cpu->cycles);
+}
+
 void pha_imp(t_cpu *cpu) { stack_push(cpu, cpu->A); }              // 0x48
-void php_imp(t_cpu *cpu) { stack_push(cpu, cpu->P | 0b00110000); } // 0x08
+void php_imp(t_cpu *cpu) {
+    stack_push(cpu, cpu_get_p(cpu) | 0b00110000);
+} // 0x08
 void pla_imp(t_cpu *cpu) {
     cpu->A = stack_pop(cpu);
     UPDATE_ZNFLAGS(cpu->A);
 } // 0x68
-void plp_imp(t_cpu *cpu) { cpu->P = stack_pop(cpu); } // 0x28
+void plp_imp(t_cpu *cpu) {
+    cpu_set_p(cpu, stack_pop(cpu));
+    irq_poll(cpu);
+} // 0x28
 
 void clc_imp(t_cpu *cpu) { CLEAR_CFLAG; } // 0x18
 void cld_imp(t_cpu *cpu) { CLEAR_DFLAG; } // 0xd8
-void cli_imp(t_cpu *cpu) { CLEAR_IFLAG; } // 0x58
+void cli_imp(t_cpu *cpu) {
+    CLEAR_IFLAG;
+    irq_poll(cpu);
+} // 0x58
 void clv_imp(t_cpu *cpu) { CLEAR_VFLAG; } // 0xb8
 
 void sec_imp(t_cpu *cpu) { SET_CFLAG; } // 0x38
@@ -519,14 +531,15 @@ void sei_imp(t_cpu *cpu) { SET_IFLAG; } // 0x78
 
 void brk_imp(t_cpu *cpu) {
     stack_push16(cpu, cpu->PC + 2);
-    stack_push(cpu, cpu->P | 0b00110000);
+    stack_push(cpu, cpu_get_p(cpu) | 0b00110000);
     SET_IFLAG;
     cpu->PC = read16(cpu, 0xfffe);
 } // 0x00
 
 void rti_imp(t_cpu *cpu) {
-    cpu->P = stack_pop(cpu) & ~BFLAG;
+    cpu_set_p(cpu, stack_pop(cpu) & ~BFLAG);
     cpu->PC = stack_pop16(cpu);
+    irq_poll(cpu);
 } // 0x40
 void rts_imp(t_cpu *cpu) {
     cpu->PC = stack_pop16(cpu);
@@ -544,7 +557,7 @@ void jsr_abs(t_cpu *cpu) {
 
 int do_nmi(t_cpu *cpu) {
     stack_push16(cpu, cpu->PC);
-    stack_push(cpu, cpu->P | 0b00110000);
+    stack_push(cpu, cpu_get_p(cpu) | 0b00110000);
     SET_IFLAG;
     cpu->PC = read16(cpu, 0xfffa);
     return 7;
@@ -554,7 +567,7 @@ int do_irq(t_cpu *cpu) {
     if (IS_IFLAG)
         return 0;
     stack_push16(cpu, cpu->PC);
-    stack_push(cpu, cpu->P | 0b00110000);
+    stack_push(cpu, cpu_get_p(cpu) | 0b00110000);
     SET_IFLAG;
     cpu->PC = read16(cpu, 0xfffe);
     return 7;
@@ -586,159 +599,166 @@ typedef struct instruction {
     bool has_extra_cycles;
 } t_instruction;
 
-struct instruction insns[] = {
-    {0x69, adc_imm, "adc", immediate, 2, 2, false},
-    {0x65, adc_zpg, "adc", zero_page, 2, 3, false},
-    {0x75, adc_zpx, "adc", zero_page_x, 2, 4, false},
-    {0x6d, adc_abs, "adc", absolute, 3, 4, false},
-    {0x7d, adc_abx, "adc", absolute_x, 3, 4, true},
-    {0x79, adc_aby, "adc", absolute_y, 3, 4, true},
-    {0x61, adc_idx, "adc", indirect_x, 2, 6, false},
-    {0x71, adc_idy, "adc", indirect_y, 2, 5, true},
-    {0x29, and_imm, "and", immediate, 2, 2, false},
-    {0x25, and_zpg, "and", zero_page, 2, 3, false},
-    {0x35, and_zpx, "and", zero_page_x, 2, 4, false},
-    {0x2d, and_abs, "and", absolute, 3, 4, false},
-    {0x3d, and_abx, "and", absolute_x, 3, 4, true},
-    {0x39, and_aby, "and", absolute_y, 3, 4, true},
-    {0x21, and_idx, "and", indirect_x, 2, 6, false},
-    {0x31, and_idy, "and", indirect_y, 2, 5, true},
-    {0x0a, asl_acc, "asl", accumulator, 1, 2, false},
-    {0x06, asl_zpg, "asl", zero_page, 2, 5, false},
-    {0x16, asl_zpx, "asl", zero_page_x, 2, 6, false},
-    {0x0e, asl_abs, "asl", absolute, 3, 6, false},
-    {0x1e, asl_abx, "asl", absolute_x, 3, 7, false},
-    {0x90, bcc_rel, "bcc", relative, 2, 2, true},
-    {0xb0, bcs_rel, "bcs", relative, 2, 2, true},
-    {0xf0, beq_rel, "beq", relative, 2, 2, true},
-    {0x30, bmi_rel, "bmi", relative, 2, 2, true},
-    {0xd0, bne_rel, "bne", relative, 2, 2, true},
-    {0x10, bpl_rel, "bpl", relative, 2, 2, true},
-    {0x50, bvc_rel, "bvc", relative, 2, 2, true},
-    {0x70, bvs_rel, "bvs", relative, 2, 2, true},
-    {0x24, bit_zpg, "bit", zero_page, 2, 3, false},
-    {0x2c, bit_abs, "bit", absolute, 3, 4, false},
-    {0x00, brk_imp, "brk", implied, 1, 7, false},
-    {0x18, clc_imp, "clc", implied, 1, 2, false},
-    {0xd8, cld_imp, "cld", implied, 1, 2, false},
-    {0x58, cli_imp, "cli", implied, 1, 2, false},
-    {0xb8, clv_imp, "clv", implied, 1, 2, false},
-    {0xc9, cmp_imm, "cmp", immediate, 2, 2, false},
-    {0xc5, cmp_zpg, "cmp", zero_page, 2, 3, false},
-    {0xd5, cmp_zpx, "cmp", zero_page_x, 2, 4, false},
-    {0xcd, cmp_abs, "cmp", absolute, 3, 4, false},
-    {0xdd, cmp_abx, "cmp", absolute_x, 3, 4, true},
-    {0xd9, cmp_aby, "cmp", absolute_y, 3, 4, true},
-    {0xc1, cmp_idx, "cmp", indirect_x, 2, 6, false},
-    {0xd1, cmp_idy, "cmp", indirect_y, 2, 5, true},
-    {0xe0, cpx_imm, "cpx", immediate, 2, 2, false},
-    {0xe4, cpx_zpg, "cpx", zero_page, 2, 3, false},
-    {0xec, cpx_abs, "cpx", absolute, 3, 4, false},
-    {0xc0, cpy_imm, "cpy", immediate, 2, 2, false},
-    {0xc4, cpy_zpg, "cpy", zero_page, 2, 3, false},
-    {0xcc, cpy_abs, "cpy", absolute, 3, 4, false},
-    {0xc6, dec_zpg, "dec", zero_page, 2, 5, false},
-    {0xd6, dec_zpx, "dec", zero_page_x, 2, 6, false},
-    {0xce, dec_abs, "dec", absolute, 3, 6, false},
-    {0xde, dec_abx, "dec", absolute_x, 3, 7, false},
-    {0xca, dex_imp, "dex", implied, 1, 2, false},
-    {0x88, dey_imp, "dey", implied, 1, 2, false},
-    {0x49, eor_imm, "eor", immediate, 2, 2, false},
-    {0x45, eor_zpg, "eor", zero_page, 2, 3, false},
-    {0x55, eor_zpx, "eor", zero_page_x, 2, 4, false},
-    {0x4d, eor_abs, "eor", absolute, 3, 4, false},
-    {0x5d, eor_abx, "eor", absolute_x, 3, 4, true},
-    {0x59, eor_aby, "eor", absolute_y, 3, 4, true},
-    {0x41, eor_idx, "eor", indirect_x, 2, 6, false},
-    {0x51, eor_idy, "eor", indirect_y, 2, 5, true},
-    {0xe6, inc_zpg, "inc", zero_page, 2, 5, false},
-    {0xf6, inc_zpx, "inc", zero_page_x, 2, 6, false},
-    {0xee, inc_abs, "inc", absolute, 3, 6, false},
-    {0xfe, inc_abx, "inc", absolute_x, 3, 7, false},
-    {0xe8, inx_imp, "inx", implied, 1, 2, false},
-    {0xc8, iny_imp, "iny", implied, 1, 2, false},
-    {0x4c, jmp_abs, "jmp", absolute, 3, 3, false},
-    {0x6c, jmp_ind, "jmp", indirect, 3, 5, false},
-    {0x20, jsr_abs, "jsr", absolute, 3, 6, false},
-    {0xa9, lda_imm, "lda", immediate, 2, 2, false},
-    {0xa5, lda_zpg, "lda", zero_page, 2, 3, false},
-    {0xb5, lda_zpx, "lda", zero_page_x, 2, 4, false},
-    {0xad, lda_abs, "lda", absolute, 3, 4, false},
-    {0xbd, lda_abx, "lda", absolute_x, 3, 4, true},
-    {0xb9, lda_aby, "lda", absolute_y, 3, 4, true},
-    {0xa1, lda_idx, "lda", indirect_x, 2, 6, false},
-    {0xb1, lda_idy, "lda", indirect_y, 2, 5, true},
-    {0xa2, ldx_imm, "ldx", immediate, 2, 2, false},
-    {0xa6, ldx_zpg, "ldx", zero_page, 2, 3, false},
-    {0xb6, ldx_zpy, "ldx", zero_page_y, 2, 4, false},
-    {0xae, ldx_abs, "ldx", absolute, 3, 4, false},
-    {0xbe, ldx_aby, "ldx", absolute_y, 3, 4, true},
-    {0xa0, ldy_imm, "ldy", immediate, 2, 2, false},
-    {0xa4, ldy_zpg, "ldy", zero_page, 2, 3, false},
-    {0xb4, ldy_zpx, "ldy", zero_page_x, 2, 4, false},
-    {0xac, ldy_abs, "ldy", absolute, 3, 4, false},
-    {0xbc, ldy_abx, "ldy", absolute_x, 3, 4, true},
-    {0x4a, lsr_acc, "lsr", accumulator, 1, 2, false},
-    {0x46, lsr_zpg, "lsr", zero_page, 2, 5, false},
-    {0x56, lsr_zpx, "lsr", zero_page_x, 2, 6, false},
-    {0x4e, lsr_abs, "lsr", absolute, 3, 6, false},
-    {0x5e, lsr_abx, "lsr", absolute_x, 3, 7, false},
-    {0xea, nop_imp, "nop", implied, 1, 2, false},
-    {0x09, ora_imm, "ora", immediate, 2, 2, false},
-    {0x05, ora_zpg, "ora", zero_page, 2, 3, false},
-    {0x15, ora_zpx, "ora", zero_page_x, 2, 4, false},
-    {0x0d, ora_abs, "ora", absolute, 3, 4, false},
-    {0x1d, ora_abx, "ora", absolute_x, 3, 4, true},
-    {0x19, ora_aby, "ora", absolute_y, 3, 4, true},
-    {0x01, ora_idx, "ora", indirect_x, 2, 6, false},
-    {0x11, ora_idy, "ora", indirect_y, 2, 5, true},
-    {0x48, pha_imp, "pha", implied, 1, 3, false},
-    {0x08, php_imp, "php", implied, 1, 3, false},
-    {0x68, pla_imp, "pla", implied, 1, 4, false},
-    {0x28, plp_imp, "plp", implied, 1, 4, false},
-    {0x2a, rol_acc, "rol", accumulator, 1, 2, false},
-    {0x26, rol_zpg, "rol", zero_page, 2, 5, false},
-    {0x36, rol_zpx, "rol", zero_page_x, 2, 6, false},
-    {0x2e, rol_abs, "rol", absolute, 3, 6, false},
-    {0x3e, rol_abx, "rol", absolute_x, 3, 7, false},
-    {0x6a, ror_acc, "ror", accumulator, 1, 2, false},
-    {0x66, ror_zpg, "ror", zero_page, 2, 5, false},
-    {0x76, ror_zpx, "ror", zero_page_x, 2, 6, false},
-    {0x6e, ror_abs, "ror", absolute, 3, 6, false},
-    {0x7e, ror_abx, "ror", absolute_x, 3, 7, false},
-    {0x40, rti_imp, "rti", implied, 1, 6, false},
-    {0x60, rts_imp, "rts", implied, 1, 6, false},
-    {0xe9, sbc_imm, "sbc", immediate, 2, 2, false},
-    {0xe5, sbc_zpg, "sbc", zero_page, 2, 3, false},
-    {0xf5, sbc_zpx, "sbc", zero_page_x, 2, 4, false},
-    {0xed, sbc_abs, "sbc", absolute, 3, 4, false},
-    {0xfd, sbc_abx, "sbc", absolute_x, 3, 4, true},
-    {0xf9, sbc_aby, "sbc", absolute_y, 3, 4, true},
-    {0xe1, sbc_idx, "sbc", indirect_x, 2, 6, false},
-    {0xf1, sbc_idy, "sbc", indirect_y, 2, 5, true},
-    {0x38, sec_imp, "sec", implied, 1, 2, false},
-    {0xf8, sed_imp, "sed", implied, 1, 2, false},
-    {0x78, sei_imp, "sei", implied, 1, 2, false},
-    {0x85, sta_zpg, "sta", zero_page, 2, 3, false},
-    {0x95, sta_zpx, "sta", zero_page_x, 2, 4, false},
-    {0x8d, sta_abs, "sta", absolute, 3, 4, false},
-    {0x9d, sta_abx, "sta", absolute_x, 3, 5, false},
-    {0x99, sta_aby, "sta", absolute_y, 3, 5, false},
-    {0x81, sta_idx, "sta", indirect_x, 2, 6, false},
-    {0x91, sta_idy, "sta", indirect_y, 2, 6, false},
-    {0x86, stx_zpg, "stx", zero_page, 2, 3, false},
-    {0x96, stx_zpy, "stx", zero_page_y, 2, 4, false},
-    {0x8e, stx_abs, "stx", absolute, 3, 4, false},
-    {0x84, sty_zpg, "sty", zero_page, 2, 3, false},
-    {0x94, sty_zpx, "sty", zero_page_x, 2, 4, false},
-    {0x8c, sty_abs, "sty", absolute, 3, 4, false},
-    {0xaa, tax_imp, "tax", implied, 1, 2, false},
-    {0xa8, tay_imp, "tay", implied, 1, 2, false},
-    {0xba, tsx_imp, "tsx", implied, 1, 2, false},
-    {0x8a, txa_imp, "txa", implied, 1, 2, false},
-    {0x9a, txs_imp, "txs", implied, 1, 2, false},
-    {0x98, tya_imp, "tya", implied, 1, 2, false},
-};
+// every official opcode: opcode, handler, name, mode, bytes, cycles and
+// whether the handler adds extra_cycles. Expanded into insns[] below and
+// into the threaded dispatch of cpu_run().
+#define INSTRUCTIONS(X)                                                        \
+    X(0x69, adc_imm, "adc", immediate, 2, 2, false)                            \
+    X(0x65, adc_zpg, "adc", zero_page, 2, 3, false)                            \
+    X(0x75, adc_zpx, "adc", zero_page_x, 2, 4, false)                          \
+    X(0x6d, adc_abs, "adc", absolute, 3, 4, false)                             \
+    X(0x7d, adc_abx, "adc", absolute_x, 3, 4, true)                            \
+    X(0x79, adc_aby, "adc", absolute_y, 3, 4, true)                            \
+    X(0x61, adc_idx, "adc", indirect_x, 2, 6, false)                           \
+    X(0x71, adc_idy, "adc", indirect_y, 2, 5, true)                            \
+    X(0x29, and_imm, "and", immediate, 2, 2, false)                            \
+    X(0x25, and_zpg, "and", zero_page, 2, 3, false)                            \
+    X(0x35, and_zpx, "and", zero_page_x, 2, 4, false)                          \
+    X(0x2d, and_abs, "and", absolute, 3, 4, false)                             \
+    X(0x3d, and_abx, "and", absolute_x, 3, 4, true)                            \
+    X(0x39, and_aby, "and", absolute_y, 3, 4, true)                            \
+    X(0x21, and_idx, "and", indirect_x, 2, 6, false)                           \
+    X(0x31, and_idy, "and", indirect_y, 2, 5, true)                            \
+    X(0x0a, asl_acc, "asl", accumulator, 1, 2, false)                          \
+    X(0x06, asl_zpg, "asl", zero_page, 2, 5, false)                            \
+    X(0x16, asl_zpx, "asl", zero_page_x, 2, 6, false)                          \
+    X(0x0e, asl_abs, "asl", absolute, 3, 6, false)                             \
+    X(0x1e, asl_abx, "asl", absolute_x, 3, 7, false)                           \
+    X(0x90, bcc_rel, "bcc", relative, 2, 2, true)                              \
+    X(0xb0, bcs_rel, "bcs", relative, 2, 2, true)                              \
+    X(0xf0, beq_rel, "beq", relative, 2, 2, true)                              \
+    X(0x30, bmi_rel, "bmi", relative, 2, 2, true)                              \
+    X(0xd0, bne_rel, "bne", relative, 2, 2, true)                              \
+    X(0x10, bpl_rel, "bpl", relative, 2, 2, true)                              \
+    X(0x50, bvc_rel, "bvc", relative, 2, 2, true)                              \
+    X(0x70, bvs_rel, "bvs", relative, 2, 2, true)                              \
+    X(0x24, bit_zpg, "bit", zero_page, 2, 3, false)                            \
+    X(0x2c, bit_abs, "bit", absolute, 3, 4, false)                             \
+    X(0x00, brk_imp, "brk", implied, 1, 7, false)                              \
+    X(0x18, clc_imp, "clc", implied, 1, 2, false)                              \
+    X(0xd8, cld_imp, "cld", implied, 1, 2, false)                              \
+    X(0x58, cli_imp, "cli", implied, 1, 2, false)                              \
+    X(0xb8, clv_imp, "clv", implied, 1, 2, false)                              \
+    X(0xc9, cmp_imm, "cmp", immediate, 2, 2, false)                            \
+    X(0xc5, cmp_zpg, "cmp", zero_page, 2, 3, false)                            \
+    X(0xd5, cmp_zpx, "cmp", zero_page_x, 2, 4, false)                          \
+    X(0xcd, cmp_abs, "cmp", absolute, 3, 4, false)                             \
+    X(0xdd, cmp_abx, "cmp", absolute_x, 3, 4, true)                            \
+    X(0xd9, cmp_aby, "cmp", absolute_y, 3, 4, true)                            \
+    X(0xc1, cmp_idx, "cmp", indirect_x, 2, 6, false)                           \
+    X(0xd1, cmp_idy, "cmp", indirect_y, 2, 5, true)                            \
+    X(0xe0, cpx_imm, "cpx", immediate, 2, 2, false)                            \
+    X(0xe4, cpx_zpg, "cpx", zero_page, 2, 3, false)                            \
+    X(0xec, cpx_abs, "cpx", absolute, 3, 4, false)                             \
+    X(0xc0, cpy_imm, "cpy", immediate, 2, 2, false)                            \
+    X(0xc4, cpy_zpg, "cpy", zero_page, 2, 3, false)                            \
+    X(0xcc, cpy_abs, "cpy", absolute, 3, 4, false)                             \
+    X(0xc6, dec_zpg, "dec", zero_page, 2, 5, false)                            \
+    X(0xd6, dec_zpx, "dec", zero_page_x, 2, 6, false)                          \
+    X(0xce, dec_abs, "dec", absolute, 3, 6, false)                             \
+    X(0xde, dec_abx, "dec", absolute_x, 3, 7, false)                           \
+    X(0xca, dex_imp, "dex", implied, 1, 2, false)                              \
+    X(0x88, dey_imp, "dey", implied, 1, 2, false)                              \
+    X(0x49, eor_imm, "eor", immediate, 2, 2, false)                            \
+    X(0x45, eor_zpg, "eor", zero_page, 2, 3, false)                            \
+    X(0x55, eor_zpx, "eor", zero_page_x, 2, 4, false)                          \
+    X(0x4d, eor_abs, "eor", absolute, 3, 4, false)                             \
+    X(0x5d, eor_abx, "eor", absolute_x, 3, 4, true)                            \
+    X(0x59, eor_aby, "eor", absolute_y, 3, 4, true)                            \
+    X(0x41, eor_idx, "eor", indirect_x, 2, 6, false)                           \
+    X(0x51, eor_idy, "eor", indirect_y, 2, 5, true)                            \
+    X(0xe6, inc_zpg, "inc", zero_page, 2, 5, false)                            \
+    X(0xf6, inc_zpx, "inc", zero_page_x, 2, 6, false)                          \
+    X(0xee, inc_abs, "inc", absolute, 3, 6, false)                             \
+    X(0xfe, inc_abx, "inc", absolute_x, 3, 7, false)                           \
+    X(0xe8, inx_imp, "inx", implied, 1, 2, false)                              \
+    X(0xc8, iny_imp, "iny", implied, 1, 2, false)                              \
+    X(0x4c, jmp_abs, "jmp", absolute, 3, 3, false)                             \
+    X(0x6c, jmp_ind, "jmp", indirect, 3, 5, false)                             \
+    X(0x20, jsr_abs, "jsr", absolute, 3, 6, false)                             \
+    X(0xa9, lda_imm, "lda", immediate, 2, 2, false)                            \
+    X(0xa5, lda_zpg, "lda", zero_page, 2, 3, false)                            \
+    X(0xb5, lda_zpx, "lda", zero_page_x, 2, 4, false)                          \
+    X(0xad, lda_abs, "lda", absolute, 3, 4, false)                             \
+    X(0xbd, lda_abx, "lda", absolute_x, 3, 4, true)                            \
+    X(0xb9, lda_aby, "lda", absolute_y, 3, 4, true)                            \
+    X(0xa1, lda_idx, "lda", indirect_x, 2, 6, false)                           \
+    X(0xb1, lda_idy, "lda", indirect_y, 2, 5, true)                            \
+    X(0xa2, ldx_imm, "ldx", immediate, 2, 2, false)                            \
+    X(0xa6, ldx_zpg, "ldx", zero_page, 2, 3, false)                            \
+    X(0xb6, ldx_zpy, "ldx", zero_page_y, 2, 4, false)                          \
+    X(0xae, ldx_abs, "ldx", absolute, 3, 4, false)                             \
+    X(0xbe, ldx_aby, "ldx", absolute_y, 3, 4, true)                            \
+    X(0xa0, ldy_imm, "ldy", immediate, 2, 2, false)                            \
+    X(0xa4, ldy_zpg, "ldy", zero_page, 2, 3, false)                            \
+    X(0xb4, ldy_zpx, "ldy", zero_page_x, 2, 4, false)                          \
+    X(0xac, ldy_abs, "ldy", absolute, 3, 4, false)                             \
+    X(0xbc, ldy_abx, "ldy", absolute_x, 3, 4, true)                            \
+    X(0x4a, lsr_acc, "lsr", accumulator, 1, 2, false)                          \
+    X(0x46, lsr_zpg, "lsr", zero_page, 2, 5, false)                            \
+    X(0x56, lsr_zpx, "lsr", zero_page_x, 2, 6, false)                          \
+    X(0x4e, lsr_abs, "lsr", absolute, 3, 6, false)                             \
+    X(0x5e, lsr_abx, "lsr", absolute_x, 3, 7, false)                           \
+    X(0xea, nop_imp, "nop", implied, 1, 2, false)                              \
+    X(0x09, ora_imm, "ora", immediate, 2, 2, false)                            \
+    X(0x05, ora_zpg, "ora", zero_page, 2, 3, false)                            \
+    X(0x15, ora_zpx, "ora", zero_page_x, 2, 4, false)                          \
+    X(0x0d, ora_abs, "ora", absolute, 3, 4, false)                             \
+    X(0x1d, ora_abx, "ora", absolute_x, 3, 4, true)                            \
+    X(0x19, ora_aby, "ora", absolute_y, 3, 4, true)                            \
+    X(0x01, ora_idx, "ora", indirect_x, 2, 6, false)                           \
+    X(0x11, ora_idy, "ora", indirect_y, 2, 5, true)                            \
+    X(0x48, pha_imp, "pha", implied, 1, 3, false)                              \
+    X(0x08, php_imp, "php", implied, 1, 3, false)                              \
+    X(0x68, pla_imp, "pla", implied, 1, 4, false)                              \
+    X(0x28, plp_imp, "plp", implied, 1, 4, false)                              \
+    X(0x2a, rol_acc, "rol", accumulator, 1, 2, false)                          \
+    X(0x26, rol_zpg, "rol", zero_page, 2, 5, false)                            \
+    X(0x36, rol_zpx, "rol", zero_page_x, 2, 6, false)                          \
+    X(0x2e, rol_abs, "rol", absolute, 3, 6, false)                             \
+    X(0x3e, rol_abx, "rol", absolute_x, 3, 7, false)                           \
+    X(0x6a, ror_acc, "ror", accumulator, 1, 2, false)                          \
+    X(0x66, ror_zpg, "ror", zero_page, 2, 5, false)                            \
+    X(0x76, ror_zpx, "ror", zero_page_x, 2, 6, false)                          \
+    X(0x6e, ror_abs, "ror", absolute, 3, 6, false)                             \
+    X(0x7e, ror_abx, "ror", absolute_x, 3, 7, false)                           \
+    X(0x40, rti_imp, "rti", implied, 1, 6, false)                              \
+    X(0x60, rts_imp, "rts", implied, 1, 6, false)                              \
+    X(0xe9, sbc_imm, "sbc", immediate, 2, 2, false)                            \
+    X(0xe5, sbc_zpg, "sbc", zero_page, 2, 3, false)                            \
+    X(0xf5, sbc_zpx, "sbc", zero_page_x, 2, 4, false)                          \
+    X(0xed, sbc_abs, "sbc", absolute, 3, 4, false)                             \
+    X(0xfd, sbc_abx, "sbc", absolute_x, 3, 4, true)                            \
+    X(0xf9, sbc_aby, "sbc", absolute_y, 3, 4, true)                            \
+    X(0xe1, sbc_idx, "sbc", indirect_x, 2, 6, false)                           \
+    X(0xf1, sbc_idy, "sbc", indirect_y, 2, 5, true)                            \
+    X(0x38, sec_imp, "sec", implied, 1, 2, false)                              \
+    X(0xf8, sed_imp, "sed", implied, 1, 2, false)                              \
+    X(0x78, sei_imp, "sei", implied, 1, 2, false)                              \
+    X(0x85, sta_zpg, "sta", zero_page, 2, 3, false)                            \
+    X(0x95, sta_zpx, "sta", zero_page_x, 2, 4, false)                          \
+    X(0x8d, sta_abs, "sta", absolute, 3, 4, false)                             \
+    X(0x9d, sta_abx, "sta", absolute_x, 3, 5, false)                           \
+    X(0x99, sta_aby, "sta", absolute_y, 3, 5, false)                           \
+    X(0x81, sta_idx, "sta", indirect_x, 2, 6, false)                           \
+    X(0x91, sta_idy, "sta", indirect_y, 2, 6, false)                           \
+    X(0x86, stx_zpg, "stx", zero_page, 2, 3, false)                            \
+    X(0x96, stx_zpy, "stx", zero_page_y, 2, 4, false)                          \
+    X(0x8e, stx_abs, "stx", absolute, 3, 4, false)                             \
+    X(0x84, sty_zpg, "sty", zero_page, 2, 3, false)                            \
+    X(0x94, sty_zpx, "sty", zero_page_x, 2, 4, false)                          \
+    X(0x8c, sty_abs, "sty", absolute, 3, 4, false)                             \
+    X(0xaa, tax_imp, "tax", implied, 1, 2, false)                              \
+    X(0xa8, tay_imp, "tay", implied, 1, 2, false)                              \
+    X(0xba, tsx_imp, "tsx", implied, 1, 2, false)                              \
+    X(0x8a, txa_imp, "txa", implied, 1, 2, false)                              \
+    X(0x9a, txs_imp, "txs", implied, 1, 2, false)                              \
+    X(0x98, tya_imp, "tya", implied, 1, 2, false)
+
+#define INSTRUCTION(OPCODE, FN, NAME, MODE, BYTES, CYCLES, EXTRA)              \
+    {OPCODE, FN, NAME, MODE, BYTES, CYCLES, EXTRA},
+struct instruction insns[] = {INSTRUCTIONS(INSTRUCTION)};
+#undef INSTRUCTION
 
 //
 // +-------------+
@@ -775,45 +795,82 @@ struct instruction insns[] = {
 // 3 bytes absolute_y
 // 3 bytes indirect
 
-t_instruction *get_instruction(uint8_t opcode) {
-    for (int i = 0; i < 151; i++) {
-        if (insns[i].opcode == opcode)
-            return &insns[i];
-    }
-    return NULL;
+static void illegal_opcode(t_cpu *cpu) {
+    cpu->halted = NESMU_ILLEGAL_OPCODE;
+    cpu->deadline = 0;
 }
 
+static t_instruction illegal = {0x00, illegal_opcode, "???", implied,
+                                1,    2,              false};
+
+// direct-indexed dispatch, every slot not covered by insns[] is `illegal`
+static t_instruction *opcodes[256];
+
+__attribute__((constructor)) static void build_opcodes(void) {
+    size_t i;
+
+    for (i = 0; i < 256; i++)
+        opcodes[i] = &illegal;
+    for (i = 0; i < sizeof(insns) / sizeof(insns[0]); i++)
+        opcodes[insns[i].opcode] = &insns[i];
+}
+
+static inline t_instruction *get_instruction(uint8_t opcode) {
+    return opcodes[opcode];
+}
+
+// same order as enum mode, these are the handler name suffixes
+static const char *mode_names[] = {"abs", "abx", "aby", "acc", "imm",
+                                   "imp", "ind", "idx", "idy", "rel",
+                                   "zpg", "zpx", "zpy"};
+
+// opcode table lookup for tools (opbench.c), false for illegal opcodes
+bool cpu_opcode_info(uint8_t opcode, const char **name, const char **mode) {
+    t_instruction *instruction = get_instruction(opcode);
+
+    if (instruction == &illegal)
+        return false;
+
+    *name = instruction->name;
+    *mode = mode_names[instruction->mode];
+    return true;
+}
+
+// the cycle a store writes on, the last one of the instruction. Only
+// meaningful from a write handler, while PC is still at the opcode and
+// cycles at the first cycle of the instruction.
+uint64_t cpu_write_cycle(t_nes *nes) {
+    t_cpu *cpu = &(nes->cpu);
+    t_instruction *instruction = get_instruction(bus_read(cpu, cpu->PC));
+    return cpu->cycles + instruction->num_cycles - 1;
+}
+
+// BEQ to itself with Z set, only asked when the opcode is 0xf0
 static bool is_endless_loop(t_nes *nes) {
     t_cpu *cpu = &(nes->cpu);
-    uint8_t a = nes->memory[cpu->PC];
     uint8_t b = nes->memory[cpu->PC + 1];
-    return a == 0xf0 && b == 0xfe && (IS_ZFLAG);
+    return b == 0xfe && (IS_ZFLAG);
+}
+
+static void endless_loop(t_cpu *cpu) {
+    cpu->halted = NESMU_ENDLESS_LOOP;
+    cpu->deadline = 0;
 }
 
 /* clang-format off */
 int run_opcode(t_nes *nes, bool debug) {
     t_cpu *cpu = &(nes->cpu);
-
-    if (cpu->dmc_halt_cycles) {
-        cpu->dmc_halt_cycles -= 1;
-        return 1;
-    }
-
     uint16_t opcode, pc;
     int retval;
 
-    opcode = cpu->read(cpu->userdata, cpu->PC);
+    opcode = bus_read(cpu, cpu->PC);
     cpu->last_read = opcode;
 
     t_instruction *instruction = get_instruction(opcode);
-    if (!instruction) {
-        printf("unknown instruction %02x\n", opcode);
-        exit(1);
-    }
 
     if (debug) {
-        printf("PC: %04x Ins: %s Bytes: %02x%02x%02x VBL:%d A:%02X X:%02X Y:%02X P:%02X SP:%02X PPU:%3d,%3d CYC:%d\n",
-            cpu->PC, instruction ? instruction->name : "???",
+        printf("PC: %04x Ins: %s Bytes: %02x%02x%02x VBL:%d A:%02X X:%02X Y:%02X P:%02X SP:%02X PPU:%3d,%3d CYC:%" PRIu64 "\n",
+            cpu->PC, instruction->name,
             nes->memory[cpu->PC],
             nes->memory[cpu->PC + 1],
             nes->memory[cpu->PC + 2],
@@ -821,20 +878,27 @@ int run_opcode(t_nes *nes, bool debug) {
             cpu->A,
             cpu->X,
             cpu->Y,
-            cpu->P | 0b00100000,
+            cpu_get_p(cpu) | 0b00100000,
             cpu->S,
             ppu_get_y(nes),
             ppu_get_x(nes),
             cpu->cycles);
     }
 
-    if (is_endless_loop(nes)) {
-        printf("endless loop detected\n");
-        exit(1);
+    if (opcode == 0xf0 && is_endless_loop(nes)) {
+        endless_loop(cpu);
+        return 0;
+    }
+
+    // halt on the opcode, it is neither counted nor stepped over
+    if (instruction == &illegal) {
+        illegal_opcode(cpu);
+        return 0;
     }
 
     pc = cpu->PC;
     cpu->extra_cycles = 0;
+    cpu->instructions += 1;
 
     instruction->fn(cpu);
     if ((cpu->PC == pc) && (opcode != 0x4c)) {
@@ -845,3 +909,91 @@ int run_opcode(t_nes *nes, bool debug) {
     retval += instruction->has_extra_cycles ? cpu->extra_cycles : 0;
     return retval;
 }
+/* clang-format on */
+
+#ifdef __GNUC__
+// threaded dispatch: every opcode gets its own copy of the code around
+// the handler, with the handler called directly (and inlined) and the
+// next opcode fetched and jumped to from there, so the host can predict
+// each jump from the instruction before it. Same steps as run_opcode().
+#define DISPATCH()                                                             \
+    do {                                                                       \
+        if (cpu->cycles >= cpu->deadline)                                      \
+            return;                                                            \
+        opcode = bus_read(cpu, cpu->PC);                                       \
+        cpu->last_read = opcode;                                               \
+        goto *labels[opcode];                                                  \
+    } while (0)
+
+#define THREADED(OPCODE, FN, NAME, MODE, BYTES, CYCLES, EXTRA)                 \
+    insn_##FN : if (OPCODE == 0xf0 && is_endless_loop(nes)) {                  \
+        endless_loop(cpu);                                                     \
+        return;                                                                \
+    }                                                                          \
+    pc = cpu->PC;                                                              \
+    cpu->extra_cycles = 0;                                                     \
+    cpu->instructions += 1;                                                    \
+    FN(cpu);                                                                   \
+    if (cpu->PC == pc && OPCODE != 0x4c)                                       \
+        cpu->PC += BYTES;                                                      \
+    cpu->cycles += CYCLES + (EXTRA ? cpu->extra_cycles : 0);                   \
+    DISPATCH();
+
+#define LABEL(OPCODE, FN, NAME, MODE, BYTES, CYCLES, EXTRA)                    \
+    [OPCODE] = &&insn_##FN,
+
+static void cpu_run_threaded(t_nes *nes) {
+    t_cpu *cpu = &(nes->cpu);
+    uint16_t pc;
+    uint8_t opcode;
+
+    // every slot not covered by INSTRUCTIONS halts, as in run_opcode()
+#pragma GCC diagnostic push
+#ifdef __clang__
+#pragma GCC diagnostic ignored "-Winitializer-overrides"
+#else
+#pragma GCC diagnostic ignored "-Woverride-init"
+#endif
+    static void *const labels[256] = {
+        [0 ... 255] = &&illegal_op,
+        INSTRUCTIONS(LABEL)
+    };
+#pragma GCC diagnostic pop
+
+    DISPATCH();
+    INSTRUCTIONS(THREADED)
+
+illegal_op:
+    illegal_opcode(cpu);
+}
+
+#undef LABEL
+#undef THREADED
+#undef DISPATCH
+#endif
+
+// run instructions up to the next scheduler deadline. A cpu stall (OAM
+// DMA) is taken here, before the first instruction: whoever adds one
+// also ends the run by clearing the deadline.
+void cpu_run(t_nes *nes, bool debug) {
+    t_cpu *cpu = &(nes->cpu);
+    uint64_t stall;
+
+    if (cpu->dmc_halt_cycles && cpu->cycles < cpu->deadline) {
+        stall = cpu->deadline - cpu->cycles;
+        stall = (stall < cpu->dmc_halt_cycles) ? stall : cpu->dmc_halt_cycles;
+        cpu->cycles += stall;
+        cpu->dmc_halt_cycles -= stall;
+    }
+
+#ifdef __GNUC__
+    if (!debug) {
+        cpu_run_threaded(nes);
+        return;
+    }
+#endif
+
+    while (cpu->cycles < cpu->deadline) {
+        cpu->cycles += run_opcode(nes, debug);
+    }
+}
@@ -0,0 +1,96 @@
+#include "shell.h"
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// no window, no audio device, no throttling: video is dropped and audio
+// is either dropped or written to a file as raw signed 16-bit mono pcm.
+// Without -f the run ends on SIGINT, as a normal exit, so that the
+// frame rate is still reported.
+
+typedef struct headless {
+    FILE *audio;
+    struct sigaction old_sigint;
+} t_headless;
+
+static volatile sig_atomic_t interrupted;
+
+static void on_sigint(int sig) { interrupted = 1; }
+
+static int headless_open(t_shell *shell) {
+    t_headless *h;
+    struct sigaction sa;
+
+    h = shell->data = calloc(1, sizeof(t_headless));
+    if (!h) {
+        perror("calloc()");
+        return 1;
+    }
+
+    sa.sa_handler = on_sigint;
+    sa.sa_flags = 0;
+    sigemptyset(&sa.sa_mask);
+    interrupted = 0;
+    if (sigaction(SIGINT, &sa, &h->old_sigint) != 0) {
+        perror("sigaction()");
+        return 1;
+    }
+    return 0;
+}
+
+static int headless_close(t_shell *shell) {
+    t_headless *h = shell->data;
+
+    if (!h) {
+        return 1;
+    }
+
+    if (h->audio) {
+        fclose(h->audio);
+    }
+
+    (void)sigaction(SIGINT, &h->old_sigint, NULL);
+    free(h);
+    shell->data = NULL;
+    return 0;
+}
+
+int headless_audio_file(t_shell *shell, const char *path) {
+    t_headless *h = shell->data;
+
+    h->audio = fopen(path, "wb");
+    if (!h->audio) {
+        perror("fopen()");
+        return 1;
+    }
+    return 0;
+}
+
+static int headless_video_write(t_shell *shell, const t_nesmu_frame *frame) {
+    return 0;
+}
+
+static int headless_poll_events(t_shell *shell, int *done) {
+    *done |= interrupted;
+    return 0;
+}
+
+static void headless_audio_write(t_shell *shell, const int16_t *samples,
+                                 size_t n) {
+    t_headless *h = shell->data;
+
+    if (h->audio) {
+        (void)fwrite(samples, sizeof(int16_t), n, h->audio);
+    }
+}
+
+static int headless_run(t_shell *shell, int (*fn)(t_shell *, void *),
+                        void *arg) {
+    return fn(shell, arg);
+}
+
+const t_shell_ops headless_shell = {
+    headless_open,        headless_close,
+    headless_video_write, headless_poll_events,
+    headless_audio_write, headless_run,
+};
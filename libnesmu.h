@@ -0,0 +1,112 @@
+#ifndef LIBNESMU_H
+#define LIBNESMU_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Embeddable emulator core. There is no global state: every t_nes is an
+// independent console and nothing here touches SDL, the terminal or the
+// clock, the host loop decides when frames are run and what to do with
+// the video and audio they produce.
+
+#define NESMU_WIDTH 256
+#define NESMU_HEIGHT 240
+#define NESMU_SAMPLING_FREQUENCY 48000
+#define NESMU_FRAME_RATE 60.0988 // NTSC, cpu clock / 29780.5
+
+// controller report bits, as shifted out of $4016
+#define NESMU_BUTTON_A 0x80
+#define NESMU_BUTTON_B 0x40
+#define NESMU_BUTTON_SELECT 0x20
+#define NESMU_BUTTON_START 0x10
+#define NESMU_BUTTON_UP 0x08
+#define NESMU_BUTTON_DOWN 0x04
+#define NESMU_BUTTON_LEFT 0x02
+#define NESMU_BUTTON_RIGHT 0x01
+
+typedef struct nes t_nes;
+
+// iNES image, NROM only (mapper 0, 16K or 32K of PRG ROM, 8K of CHR ROM
+// or none for CHR RAM). Returns NULL if the image is not supported or
+// allocation fails. The buffer is copied and can be freed afterwards.
+t_nes *nesmu_create(const void *rom, size_t size);
+void nesmu_destroy(t_nes *);
+
+enum nesmu_status {
+    NESMU_FRAME,          // a frame was completed
+    NESMU_ENDLESS_LOOP,   // branch to self with no way out, test ROMs end so
+    NESMU_ILLEGAL_OPCODE, // unofficial opcode, not emulated
+};
+
+// run until the next vblank, returns an nesmu_status. Once halted, every
+// further call returns the same status until nesmu_reset().
+int nesmu_step_frame(t_nes *);
+
+// press the reset button
+void nesmu_reset(t_nes *);
+
+// buttons is a mask of NESMU_BUTTON_*, port is 0 or 1
+void nesmu_set_controller(t_nes *, int port, uint8_t buttons);
+
+// a picture as the PPU outputs it: one palette index (0-63) per pixel,
+// and the color emphasis bits (PPUMASK bits 5-7, shifted down) of each
+// line
+typedef struct nesmu_frame {
+    uint8_t pixels[NESMU_WIDTH * NESMU_HEIGHT];
+    uint8_t emphasis[NESMU_HEIGHT];
+} t_nesmu_frame;
+
+// the last completed frame, valid until the next nesmu_step_frame()
+const t_nesmu_frame *nesmu_frame(t_nes *);
+
+// convert a frame to ARGB8888 rows pitch bytes apart, such as a locked
+// texture. Uses AVX2 or SSE2 when the host has them.
+void nesmu_frame_to_argb(const t_nesmu_frame *, void *dst, int pitch);
+
+// copy up to max mono s16 samples produced since the last call, returns
+// the number copied. Samples not drained before the internal buffer
+// fills up are dropped.
+size_t nesmu_drain_audio(t_nes *, int16_t *buf, size_t max);
+
+// dynamic rate control: produce ratio times NESMU_SAMPLING_FREQUENCY
+// samples per emulated second from now on, so that a host pacing frames
+// on vsync or a timer can keep its audio queue from draining or filling
+// up. Clamped to NESMU_MAX_RATE_PPM either way.
+#define NESMU_MAX_RATE_PPM 10000
+void nesmu_set_audio_rate(t_nes *, double ratio);
+
+// synthesize audio on a thread of its own, fed with the APU register
+// writes. The samples are the same as inline, but they come out one
+// frame later; turning the thread off hands back what is still pending.
+// Returns 0 on success, the thread could not be started otherwise.
+int nesmu_set_audio_thread(t_nes *, bool);
+
+// draw the picture on a thread of its own, fed with the PPU register
+// writes, while the next frame is emulated. The frames are the same as
+// inline, but nesmu_frame() returns each one a frame later.
+// Returns 0 on success, the thread could not be started otherwise.
+int nesmu_set_video_thread(t_nes *, bool);
+
+// print a nestest-style line for every instruction to stdout
+void nesmu_set_trace(t_nes *, bool);
+
+// blargg test ROM protocol: returns the status byte at $6000 (0x80 still
+// running, 0x81 reset needed, otherwise the final result, 0 is a pass) or
+// -1 if the ROM does not implement it. The message written at $6004 is
+// copied to text in any case.
+#define NESMU_TEST_RUNNING 0x80
+#define NESMU_TEST_NEED_RESET 0x81
+int nesmu_test_status(t_nes *, char *text, size_t size);
+
+// counters since create. apu_ns is the time spent running the APU and
+// is only measured when the library is built with -DNESMU_PROFILE.
+typedef struct nesmu_stats {
+    uint64_t instructions;
+    uint64_t cpu_cycles;
+    uint64_t apu_ticks;
+    uint64_t apu_ns;
+} t_nesmu_stats;
+void nesmu_get_stats(t_nes *, t_nesmu_stats *);
+
+#endif
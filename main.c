@@ -1,5 +1,5 @@
-#include "nesmu.h"
-#include <assert.h>
+#include "libnesmu.h"
+#include "shell.h"
 #include <fcntl.h>
 #include <stdbool.h>
 #include <stdint.h>
@@ -8,77 +8,175 @@
 #include <string.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
-uint8_t cpu_read(void *userdata, uint16_t addr) {
-    t_nes *nes = (t_nes *)userdata;
-
-    if (addr < 0x2000) {
-        // RAM
-        return nes->memory[addr & 0x7ff];
-    } else if (0x2000 <= addr && addr < 0x4000) {
-        // PPU
-        //    printf("PPU read, addr: %04x, value: %02x\n",
-        //    0x2000 + (addr & 7), memory[0x2000 + (addr & 7)]);
-        return ppu_read(userdata, 0x2000 + (addr & 7));
-    } else if (0x4000 <= addr && addr < 0x4020) {
-        // APU
-        uint8_t val = apu_read(userdata, addr);
-        // printf("APU read, addr: %04x, value: %02x, cpu = %8d\n",
-        //     addr, val, nes->cpu.cycles);
-        return val;
-    }
-
-    return nes->memory[addr];
+static double now_seconds(void) {
+    struct timespec ts;
+
+    (void)clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
 }
 
-void cpu_write(void *userdata, uint16_t addr, uint8_t val) {
-    t_nes *nes = (t_nes *)userdata;
-
-    // blargg instr_test-v5
-    if (0x6004 <= addr && addr < 0x6100) {
-        if (val)
-            putchar(val);
-    }
-
-    if (addr < 0x2000) {
-        // RAM
-        nes->memory[addr & 0x7ff] = val;
-        return;
-    } else if (0x2000 <= addr && addr < 0x4000) {
-        // PPU
-        // printf("PPU write addr:%04x val:%02x\n", 0x2000 + (addr & 7), val);
-        ppu_write(userdata, 0x2000 + (addr & 7), val);
-        return;
-    } else if (0x4000 <= addr && addr < 0x4020) {
-        // APU
-        // printf("APU write addr:%04x val:%02x cpu = %8d\n",
-        //     addr, val, nes->cpu.cycles);
-        apu_write(userdata, addr, val);
-        return;
-    }
-
-    nes->memory[addr] = val;
-    return;
+static void usage(const char *name) {
+    fprintf(stderr,
+            "usage: %s [-dHAPv] [-a audio.raw] [-l latency_ms] [-f frames] rom\n"
+            "       %s -t [-j jobs] [-f frames] rom|dir...\n"
+            "       %s -b [-f frames] rom...\n",
+            name, name, name);
+    exit(EXIT_FAILURE);
 }
 
-int main(int argc, char *argv[]) {
-    int fd, ret, opt, i, done = 0, debug = 0;
+t_nes *open_rom(const char *path) {
     struct stat st;
-    size_t size;
+    t_nes *nes;
     void *data;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        perror(path);
+        return NULL;
+    }
+
+    if (fstat(fd, &st) != 0) {
+        perror(path);
+        close(fd);
+        return NULL;
+    }
+
+    data = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    (void)close(fd);
+    if (data == MAP_FAILED) {
+        perror(path);
+        return NULL;
+    }
+
+    nes = nesmu_create(data, st.st_size);
+    (void)munmap(data, st.st_size);
+    if (!nes) {
+        fprintf(stderr, "%s: unsupported rom\n", path);
+    }
+    return nes;
+}
+
+// echo what the ROM has appended to its $6004 message since the last call
+static void print_text(t_nes *nes, size_t *printed) {
+    char text[1024];
+    size_t len;
 
-    t_nes mynes;
-    t_nes *nes = &mynes;
+    (void)nesmu_test_status(nes, text, sizeof(text));
+    len = strlen(text);
+    if (len < *printed) {
+        *printed = 0;
+    }
+    fputs(text + *printed, stdout);
+    *printed = len;
+}
+
+typedef struct emulation {
+    t_nes *nes;
+    long max_frames;
+    long frames;
+} t_emulation;
+
+// the frame loop, run by the shell on whichever thread it likes. Returns
+// the status the emulation halted with, 0 if it was stopped.
+static int emulate(t_shell *shell, void *arg) {
+    t_emulation *emu = arg;
+    t_nes *nes = emu->nes;
+    int done = 0, halted = 0;
+    double audio_rate = 1;
+    size_t n, printed = 0;
+    int16_t samples[1024];
+
+    while (!done) {
+        halted = nesmu_step_frame(nes);
+
+        while ((n = nesmu_drain_audio(nes, samples, 1024)) > 0) {
+            shell->ops->audio_write(shell, samples, n);
+        }
+        print_text(nes, &printed);
+
+        if (halted)
+            break;
+
+        shell->ops->video_write(shell, nesmu_frame(nes));
+        shell->ops->poll_events(shell, &done);
+        nesmu_set_controller(nes, 0, shell->joy1);
+        if (shell->audio_rate != audio_rate) {
+            audio_rate = shell->audio_rate;
+            nesmu_set_audio_rate(nes, audio_rate);
+        }
+        emu->frames += 1;
+        done |= emu->max_frames && emu->frames >= emu->max_frames;
+    }
+
+    // the audio thread is a frame behind, take its last frame too
+    (void)nesmu_set_audio_thread(nes, false);
+    while ((n = nesmu_drain_audio(nes, samples, 1024)) > 0) {
+        shell->ops->audio_write(shell, samples, n);
+    }
+    return halted;
+}
 
-    while ((opt = getopt(argc, argv, "d")) != -1) {
+int main(int argc, char *argv[]) {
+    int opt, debug = 0, halted = 0, test = 0, bench = 0, jobs = 0;
+    int latency = 0;
+    bool vsync = false;
+    bool audio_thread = false, video_thread = false;
+    const char *audio_path = NULL;
+    long max_frames = 0;
+    double start;
+    t_emulation emu;
+
+    t_shell myshell;
+    t_shell *shell = &myshell;
+    t_nes *nes;
+
+#ifdef NESMU_NO_SDL
+    bool headless = true;
+#else
+    bool headless = false;
+#endif
+
+    while ((opt = getopt(argc, argv, "dHAPva:l:f:tj:b")) != -1) {
         switch (opt) {
         case 'd':
             debug = 1;
             break;
+        case 'H':
+            headless = true;
+            break;
+        case 'A':
+            audio_thread = true;
+            break;
+        case 'P':
+            video_thread = true;
+            break;
+        case 'a':
+            audio_path = optarg;
+            break;
+        case 'v':
+            vsync = true;
+            break;
+        case 'l':
+            latency = strtol(optarg, NULL, 0);
+            break;
+        case 'f':
+            max_frames = strtol(optarg, NULL, 0);
+            break;
+        case 't':
+            test = 1;
+            break;
+        case 'j':
+            jobs = strtol(optarg, NULL, 0);
+            break;
+        case 'b':
+            bench = 1;
+            break;
         default: /* '?' */
-            fprintf(stderr, "usage: %s [-d] rom\n", argv[0]);
-            exit(EXIT_FAILURE);
+            usage(argv[0]);
         }
     }
 
@@ -87,71 +185,70 @@ int main(int argc, char *argv[]) {
         exit(EXIT_FAILURE);
     }
 
-    memset(nes, 0, sizeof(*nes));
-
-    if (shell_open(nes)) {
-        exit(EXIT_FAILURE);
+    if (test) {
+        return run_tests(argv + optind, argc - optind, jobs, max_frames);
     }
 
-    fd = open(argv[optind], O_RDONLY);
-    if (fd == -1) {
-        perror("open()");
-        return 1;
+    if (bench) {
+        return run_bench(argv + optind, argc - optind, max_frames);
     }
 
-    ret = fstat(fd, &st);
-    if (ret != 0) {
-        perror("fstat()");
-        close(fd);
-        return 1;
+    if (audio_path && !headless) {
+        fprintf(stderr, "-a is only supported with -H\n");
+        exit(EXIT_FAILURE);
     }
-    size = st.st_size;
 
-    data = mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0);
-    (void)close(fd);
-    if (data == NULL) {
-        perror("mmap()");
+    nes = open_rom(argv[optind]);
+    if (!nes) {
         return 1;
     }
+    nesmu_set_trace(nes, debug);
+    if (audio_thread && nesmu_set_audio_thread(nes, true)) {
+        fprintf(stderr, "could not start the audio thread\n");
+    }
+    if (video_thread && nesmu_set_video_thread(nes, true)) {
+        fprintf(stderr, "could not start the video thread\n");
+    }
+
+    memset(shell, 0, sizeof(*shell));
+    shell->audio_latency = latency;
+    shell->vsync = vsync;
+    shell->audio_rate = 1;
 
-    if (size == 16 + 32768 + 8192) {
-        memcpy(nes->memory + 0x8000, data + 16, 0x8000);
-    } else if (size == 16 + 16384 + 8192) {
-        memcpy(nes->memory + 0x8000, data + 16, 0x4000);
-        memcpy(nes->memory + 0xc000, data + 16, 0x4000);
-    } else if (size == 16 + 8192 + 8192) {
-        memcpy(nes->memory + 0x8000, data + 16, 0x4000);
-        memcpy(nes->memory + 0xc000, data + 16, 0x4000);
-    } else {
-        assert(false);
+#ifdef NESMU_NO_SDL
+    shell->ops = &headless_shell;
+#else
+    shell->ops = headless ? &headless_shell : &sdl_shell;
+#endif
+
+    if (shell->ops->open(shell)) {
+        exit(EXIT_FAILURE);
     }
-    (void)munmap(data, size);
 
-    nes->cpu.S = 0xfd;
-    nes->cpu.P = 0x24;
-    nes->cpu.userdata = nes;
-    nes->cpu.read = cpu_read;
-    nes->cpu.write = cpu_write;
-    nes->cpu.PC = nes->memory[0xfffc] + 256 * nes->memory[0xfffd];
+    if (audio_path && headless_audio_file(shell, audio_path)) {
+        exit(EXIT_FAILURE);
+    }
 
-    // nes->cpu.PC = 0xc000;
-    nes->cpu.cycles = 7; // nestest.log, nintendulator
+    emu.nes = nes;
+    emu.max_frames = max_frames;
+    emu.frames = 0;
+    start = now_seconds();
+    halted = shell->ops->run(shell, emulate, &emu);
 
-    /* start triangle at phase 16 (volume 0) to avoid initial pop */
-    nes->apu.ch[2].timer.phase = 16;
-    nes->apu.ch[3].lfsr.shift_register = 1;
+    if (halted == NESMU_ENDLESS_LOOP) {
+        printf("endless loop detected\n");
+    } else if (halted == NESMU_ILLEGAL_OPCODE) {
+        printf("unknown instruction\n");
+    }
 
-    while (!done) {
-        if (ppu_update(nes)) {
-            video_write(nes);
-            poll_events(nes, &done);
-        }
-        apu_update(nes);
-        nes->prev_cpu_cycles = nes->cpu.cycles;
-        nes->cpu.cycles += run_opcode(nes, debug);
+    if (headless) {
+        double elapsed = now_seconds() - start;
+        fprintf(stderr, "%ld frames in %.3f s, %.1f fps\n", emu.frames,
+                elapsed, elapsed > 0 ? emu.frames / elapsed : 0.0);
     }
 
-    shell_close(nes);
+    shell->ops->close(shell);
+    nesmu_destroy(nes);
 
-    return 0;
+    return halted ? 1 : 0;
 }
@@ -0,0 +1,68 @@
+#include "nesmu.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Memory map checks (make test): small NROM images are built here, run
+// until they halt on a BEQ to itself, and memory is looked at afterwards.
+
+#define PRG_SIZE 0x4000
+#define ROM_SIZE (16 + PRG_SIZE + 0x2000)
+
+// a 16K NROM image with code at $c000, which is also the reset vector
+static t_nes *create(const uint8_t *code, size_t size) {
+    static uint8_t rom[ROM_SIZE];
+    uint8_t *prg = rom + 16;
+
+    memset(rom, 0, sizeof(rom));
+    memcpy(rom, "NES\x1a\x01\x01", 6);
+    memset(prg, 0xea, PRG_SIZE);
+    memcpy(prg, code, size);
+    prg[PRG_SIZE - 4] = 0x00; // reset vector, $c000
+    prg[PRG_SIZE - 3] = 0xc0;
+    return nesmu_create(rom, sizeof(rom));
+}
+
+static int run(t_nes *nes) {
+    for (int i = 0; i < 10; i++) {
+        if (nesmu_step_frame(nes) == NESMU_ENDLESS_LOOP)
+            return 0;
+    }
+    return 1;
+}
+
+static int failures;
+
+static void check(const char *name, int ok) {
+    printf("%-40s %s\n", name, ok ? "ok" : "FAILED");
+    failures += !ok;
+}
+
+// stores to $8000 and $c000 (the same 16K mirrored) leave PRG ROM as it
+// is, a store to RAM at $0200 goes through
+static void test_rom_is_read_only(void) {
+    const uint8_t code[] = {
+        0xa9, 0x55,       // lda #$55
+        0x8d, 0x00, 0x80, // sta $8000
+        0x8d, 0x00, 0xc0, // sta $c000
+        0x8d, 0x00, 0x02, // sta $0200
+        0xa9, 0x00,       // lda #$00
+        0xf0, 0xfe,       // beq *
+    };
+    t_nes *nes = create(code, sizeof(code));
+
+    if (!nes) {
+        check("rom is read-only: create", 0);
+        return;
+    }
+    check("rom is read-only: halts", run(nes) == 0);
+    check("rom is read-only: $8000", nes->memory[0x8000] == 0xa9);
+    check("rom is read-only: $c000", nes->memory[0xc000] == 0xa9);
+    check("rom is read-only: ram $0200", nes->memory[0x0200] == 0x55);
+    nesmu_destroy(nes);
+}
+
+int main(void) {
+    test_rom_is_read_only();
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,277 @@
+#include "nesmu.h"
+#include <stdbool.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+uint8_t cpu_read(void *userdata, uint16_t addr) {
+    t_nes *nes = (t_nes *)userdata;
+
+    if (addr < 0x2000) {
+        // RAM
+        return nes->memory[addr & 0x7ff];
+    } else if (0x2000 <= addr && addr < 0x4000) {
+        // PPU
+        //    printf("PPU read, addr: %04x, value: %02x\n",
+        //    0x2000 + (addr & 7), memory[0x2000 + (addr & 7)]);
+        return ppu_read(userdata, 0x2000 + (addr & 7));
+    } else if (0x4000 <= addr && addr < 0x4020) {
+        // APU
+        uint8_t val = apu_read(userdata, addr);
+        // printf("APU read, addr: %04x, value: %02x, cpu = %8d\n",
+        //     addr, val, nes->cpu.cycles);
+        return val;
+    }
+
+    return nes->memory[addr];
+}
+
+void cpu_write(void *userdata, uint16_t addr, uint8_t val) {
+    t_nes *nes = (t_nes *)userdata;
+
+    if (addr < 0x2000) {
+        // RAM
+        nes->memory[addr & 0x7ff] = val;
+        return;
+    } else if (0x2000 <= addr && addr < 0x4000) {
+        // PPU
+        // printf("PPU write addr:%04x val:%02x\n", 0x2000 + (addr & 7), val);
+        ppu_write(userdata, 0x2000 + (addr & 7), val);
+        return;
+    } else if (addr == OAMDMA) {
+        ppu_oam_dma(userdata, val);
+        return;
+    } else if (0x4000 <= addr && addr < 0x4020) {
+        // APU
+        // printf("APU write addr:%04x val:%02x cpu = %8d\n",
+        //     addr, val, nes->cpu.cycles);
+        apu_write(userdata, addr, val);
+        return;
+    } else if (addr >= 0x8000) {
+        // PRG ROM, NROM has no registers there
+        return;
+    }
+
+    nes->memory[addr] = val;
+    return;
+}
+
+// RAM (mirrored), and everything above the I/O registers, is plain memory;
+// PPU/APU registers go through handlers. PRG ROM is plain memory for
+// reads only, stores to it go to cpu_write(), which drops them.
+static void memory_map_init(t_nes *nes) {
+    int page;
+
+    for (page = 0; page < 256; page++) {
+        uint8_t *ptr = NULL;
+
+        if (page < 0x20)
+            ptr = nes->memory + ((page & 7) << 8);
+        else if (page > 0x40)
+            ptr = nes->memory + (page << 8);
+
+        nes->cpu.read_map[page] = ptr;
+        nes->cpu.write_map[page] = (page < 0x80) ? ptr : NULL;
+    }
+}
+
+// iNES header: "NES\x1a", PRG ROM size in 16K units, CHR ROM size in 8K
+// units, flags 6 (mirroring, trainer, mapper low nibble) and flags 7
+// (mapper high nibble)
+#define INES_HEADER_SIZE 16
+#define INES_TRAINER_SIZE 512
+#define INES_TRAINER 0x04
+
+// NROM: 32K of PRG, or 16K mirrored at $c000, and 8K of CHR ROM after
+// it. Without it the cartridge has 8K of CHR RAM instead. A trainer is
+// skipped, NROM has nowhere to put it.
+static int load_rom(t_nes *nes, const uint8_t *data, size_t size) {
+    size_t prg_size, chr_size, offset = INES_HEADER_SIZE;
+    int mapper;
+
+    if (size < INES_HEADER_SIZE || memcmp(data, "NES\x1a", 4) != 0) {
+        return 1;
+    }
+
+    mapper = (data[6] >> 4) | (data[7] & 0xf0);
+    prg_size = data[4] * 0x4000;
+    chr_size = data[5] * 0x2000;
+    if (mapper != 0 || (data[4] != 1 && data[4] != 2) || data[5] > 1) {
+        return 1;
+    }
+
+    offset += (data[6] & INES_TRAINER) ? INES_TRAINER_SIZE : 0;
+    if (size < offset + prg_size + chr_size) {
+        return 1;
+    }
+
+    memcpy(nes->memory + 0x8000, data + offset, prg_size);
+    if (prg_size == 0x4000) {
+        memcpy(nes->memory + 0xc000, data + offset, 0x4000);
+    }
+
+    nes->ppu.chr_ram = data[5] == 0;
+    if (!nes->ppu.chr_ram) {
+        memcpy(nes->ppu.chr, data + offset + prg_size, 0x2000);
+    }
+    nes->ppu.vertical_mirroring = data[6] & 1;
+    return 0;
+}
+
+t_nes *nesmu_create(const void *rom, size_t size) {
+    t_nes *nes = calloc(1, sizeof(t_nes));
+
+    if (!nes) {
+        return NULL;
+    }
+
+    if (load_rom(nes, rom, size)) {
+        free(nes);
+        return NULL;
+    }
+
+    nes->cpu.S = 0xfd;
+    cpu_set_p(&(nes->cpu), 0x24);
+    nes->cpu.userdata = nes;
+    nes->cpu.read = cpu_read;
+    nes->cpu.write = cpu_write;
+    memory_map_init(nes);
+    nes->cpu.PC = nes->memory[0xfffc] + 256 * nes->memory[0xfffd];
+
+    // nes->cpu.PC = 0xc000;
+    nes->cpu.cycles = 7; // nestest.log, nintendulator
+
+    sched_init(nes);
+    ppu_init(nes);
+    apu_init(nes);
+    return nes;
+}
+
+void nesmu_destroy(t_nes *nes) {
+    if (nes->apu_thread) {
+        apu_thread_stop(nes);
+    }
+    if (nes->ppu_thread) {
+        ppu_thread_stop(nes);
+    }
+    free(nes);
+}
+
+int nesmu_step_frame(t_nes *nes) {
+    do {
+        cpu_run(nes, nes->trace);
+        if (nes->cpu.halted)
+            break;
+    } while (!sched_run(nes));
+
+    // the host takes the audio of the frame now, play the pending writes
+    apu_sync(nes);
+    if (nes->apu_thread) {
+        apu_thread_end_frame(nes);
+    }
+    if (nes->ppu_thread) {
+        ppu_thread_end_frame(nes);
+    }
+    return nes->cpu.halted;
+}
+
+// the reset button: the cpu runs its reset sequence (no writes, S drops
+// by 3, I is set) and the APU is silenced. Memory is kept.
+void nesmu_reset(t_nes *nes) {
+    t_cpu *cpu = &(nes->cpu);
+
+    cpu->S -= 3;
+    cpu_set_p(cpu, cpu_get_p(cpu) | 0x04);
+    cpu->PC = nes->memory[0xfffc] + 256 * nes->memory[0xfffd];
+    cpu->halted = NESMU_FRAME;
+    cpu->cycles += 7;
+    apu_write(nes, SND_CHN, 0);
+}
+
+void nesmu_set_controller(t_nes *nes, int port, uint8_t buttons) {
+    if (port == 0 || port == 1) {
+        nes->joy[port] = buttons;
+    }
+}
+
+const t_nesmu_frame *nesmu_frame(t_nes *nes) {
+    return nes->ppu_thread ? ppu_thread_frame(nes) : &(nes->frame);
+}
+
+void nesmu_frame_to_argb(const t_nesmu_frame *frame, void *dst, int pitch) {
+    ppu_frame_to_argb(frame, dst, pitch);
+}
+
+size_t nesmu_drain_audio(t_nes *nes, int16_t *buf, size_t max) {
+    size_t n = (nes->audio_len < max) ? nes->audio_len : max;
+
+    memcpy(buf, nes->audio_buf, n * sizeof(int16_t));
+    memmove(nes->audio_buf, nes->audio_buf + n,
+            (nes->audio_len - n) * sizeof(int16_t));
+    nes->audio_len -= n;
+
+    // what was produced inline before the thread was started comes first
+    if (nes->apu_thread) {
+        n += apu_thread_drain(nes, buf + n, max - n);
+    }
+    return n;
+}
+
+void nesmu_set_audio_rate(t_nes *nes, double ratio) {
+    double ppm = (ratio - 1) * 1e6;
+
+    ppm = (ppm < NESMU_MAX_RATE_PPM) ? ppm : NESMU_MAX_RATE_PPM;
+    ppm = (ppm > -NESMU_MAX_RATE_PPM) ? ppm : -NESMU_MAX_RATE_PPM;
+    apu_set_rate(nes, (int32_t)lrint(ppm));
+}
+
+int nesmu_set_audio_thread(t_nes *nes, bool on) {
+    if (on && !nes->apu_thread) {
+        return apu_thread_start(nes);
+    }
+    if (!on && nes->apu_thread) {
+        apu_thread_stop(nes);
+    }
+    return 0;
+}
+
+int nesmu_set_video_thread(t_nes *nes, bool on) {
+    if (on && !nes->ppu_thread) {
+        return ppu_thread_start(nes);
+    }
+    if (!on && nes->ppu_thread) {
+        ppu_thread_stop(nes);
+    }
+    return 0;
+}
+
+void nesmu_set_trace(t_nes *nes, bool trace) { nes->trace = trace; }
+
+// blargg test ROMs: status byte at $6000, valid once $6001-$6003 hold the
+// de b0 61 signature, and a NUL terminated message from $6004
+int nesmu_test_status(t_nes *nes, char *text, size_t size) {
+    const uint8_t *msg = nes->memory + 0x6004;
+    size_t i;
+
+    for (i = 0; i + 1 < size && i < 0x8000 - 0x6004 && msg[i]; i++) {
+        text[i] = msg[i];
+    }
+    if (size) {
+        text[i] = '\0';
+    }
+
+    if (nes->memory[0x6001] != 0xde || nes->memory[0x6002] != 0xb0 ||
+        nes->memory[0x6003] != 0x61) {
+        return -1;
+    }
+    return nes->memory[0x6000];
+}
+
+void nesmu_get_stats(t_nes *nes, t_nesmu_stats *stats) {
+    stats->instructions = nes->cpu.instructions;
+    stats->cpu_cycles = nes->cpu.cycles;
+    stats->apu_ticks = nes->apu.sync_cycles;
+    stats->apu_ns = nes->apu.profile_ns;
+}
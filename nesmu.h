@@ -1,7 +1,9 @@
 #ifndef NESMU_H
 #define NESMU_H
 
-#include <SDL.h>
+#include "libnesmu.h"
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdint.h>
 
@@ -36,15 +38,26 @@
 #define JOY1 0x4016
 #define JOY2 0x4017
 
-#define SAMPLING_FREQUENCY 48000
+#define SAMPLING_FREQUENCY NESMU_SAMPLING_FREQUENCY
+#define CPU_FREQUENCY 1789773
+#define AUDIO_BUF_SIZE 4096
 
 typedef struct cpu {
     uint8_t A, X, Y, S, P, u8, last_read;
     uint16_t PC, u16;
+    uint16_t nz; // last result, N and Z of P are derived from it
     void *userdata;
     uint8_t (*read)(void *userdata, uint16_t addr);
     void (*write)(void *userdata, uint16_t addr, uint8_t val);
-    uint32_t cycles;
+    // one entry per 256-byte page: direct host pointer for plain memory,
+    // NULL to go through the read/write handlers above
+    uint8_t *read_map[256];
+    uint8_t *write_map[256];
+    uint64_t cycles;
+    uint64_t instructions;
+    uint64_t deadline; // next scheduler event, cpu_run() stops there
+    bool irq_line;
+    uint8_t halted; // NESMU_ENDLESS_LOOP etc., the run is over
     uint8_t extra_cycles;
     uint32_t dmc_halt_cycles;
 } t_cpu;
@@ -119,61 +132,212 @@ typedef struct channel {
     t_dmc dmc;
 } t_channel;
 
+#define BLIP_SIZE 4096 // output samples
+#define BLIP_WIDTH 16  // taps of the band-limited step
+
+// see blip.c
+typedef struct blip {
+    uint64_t factor; // output samples per clock, 32.32 fixed point
+    uint64_t offset; // time of the current clock span in the buffer
+    int32_t integrator;
+    int32_t buf[BLIP_SIZE + BLIP_WIDTH + 1];
+} t_blip;
+
+// channel register writes wait in the log until something can observe
+// their effect, see apu_write()
+#define APU_WRITE_LOG 256
+
+typedef struct apu_write {
+    uint64_t cycle;
+    uint16_t addr;
+    uint8_t val;
+} t_apu_write;
+
 typedef struct apu {
-    double capacitor;
-    uint32_t timer_cycles;
-    uint32_t cpu_cycles_divided, cpu_cycles, scheduled_reset;
-    uint64_t audio_output_cycles;
+    int32_t dc; // DC blocking filter state
+    uint64_t sync_cycles;  // cpu cycle the channels have been run up to
+    uint64_t frame_start;  // cpu cycle of frame sequencer step 0
+    uint8_t frame_step;
+    uint64_t blip_cycles; // cpu cycle of the start of the blip clock span
+    int32_t level;        // mixer output, as last reported to blip
+    uint32_t levels;      // the five channel outputs it was computed from
+    bool levels_dirty;    // state changed outside of the channel timers
+    bool silent; // synthesis runs elsewhere, only keep what the cpu sees
+    t_blip blip;
+    uint64_t profile_ns; // time spent in apu_sync, NESMU_PROFILE builds only
     bool frame_sequencer_active;
     bool frame_counter_mode;
     bool interrupt_inhibit_flag;
     bool frame_interrupt_flag;
     bool dmc_interrupt_flag;
     t_channel ch[5];
+    t_apu_write writes[APU_WRITE_LOG];
+    int num_writes;
 } t_apu;
 
-typedef struct shell {
-    SDL_Window *window;
-    SDL_Renderer *renderer;
-    SDL_Texture *texture;
-    SDL_AudioDeviceID audio_device;
-    int16_t buf[512 * 4];
-    int buf_read_index, buf_write_index, num_available;
-    uint8_t joy1;
-} t_shell;
-
-typedef struct nes {
+#define PPU_LINE_SPRITES 8
+
+enum { OAM_Y, OAM_TILE, OAM_ATTR, OAM_X };
+
+// writes to the registers that change the picture wait in the log until
+// the picture is drawn up to them, see ppu_write()
+#define PPU_WRITE_LOG 256
+
+typedef struct ppu_write {
+    uint32_t dot; // ppu_cycles of the write
+    uint16_t addr;
+    uint8_t val;
+} t_ppu_write;
+
+// picture state, see ppu.c. v, t, x and w are the "loopy" scroll
+// registers: the current and the temporary vram address, fine x scroll
+// and the first/second write toggle shared by PPUSCROLL and PPUADDR.
+typedef struct ppu {
+    uint16_t v, t;
+    uint8_t x;
+    bool w;
+    uint8_t read_buffer; // PPUDATA reads return the previous byte
+    uint8_t oam[4][64]; // OAM_Y, OAM_TILE, OAM_ATTR, OAM_X of each sprite
+    uint8_t nametables[0x800];
+    uint8_t palette[32];
+    uint8_t chr[0x2000];
+    bool chr_ram;            // no CHR ROM, PPUDATA writes can change tiles
+    bool vertical_mirroring; // from the iNES header
+    uint8_t tiles[512][64];  // chr decoded, one 2-bit pixel per byte
+    int line;                // next scanline to render in this frame
+    uint8_t sprites[PPU_LINE_SPRITES]; // OAM entries found for that line
+    int num_sprites;
+    uint32_t hit_dot, overflow_dot; // in this frame, UINT32_MAX if none
+    bool silent; // the picture is drawn elsewhere, only keep what the cpu sees
+    bool predicted; // predicted_hit and predicted_overflow hold, see ppu.c
+    uint32_t predicted_hit, predicted_overflow;
+    t_ppu_write writes[PPU_WRITE_LOG];
+    int num_writes;
+} t_ppu;
+
+enum event {
+    EV_PPU,       // vblank set/clear, NMI edge
+    EV_APU_FRAME, // frame sequencer step
+    EV_APU_SYNC,  // channel catch-up while a DMC IRQ is pending
+    EV_IRQ,
+    NUM_EVENTS
+};
+
+typedef struct sched {
+    uint64_t when[NUM_EVENTS]; // UINT64_MAX when not scheduled
+} t_sched;
+
+struct nes {
     uint8_t memory[0x10000];
     t_cpu cpu;
     t_apu apu;
-    t_shell shell;
+    t_sched sched;
     bool NMI_occurred, NMI_output;
     bool NMI_line_status, NMI_line_status_old;
     uint8_t ppu_registers[8];
-    uint32_t prev_cpu_cycles, ppu_cycles, parity, frame_number;
-    uint8_t joy1_read_index;
-} t_nes;
+    t_ppu ppu;
+    uint64_t ppu_sync_cycles; // cpu cycle ppu_cycles was last advanced to
+    uint32_t ppu_cycles, parity, frame_number;
+    uint8_t joy[2], joy_read_index[2];
+    bool trace;
+    t_nesmu_frame frame;
+    int16_t audio_buf[AUDIO_BUF_SIZE];
+    uint32_t audio_len;
+    struct apu_thread *apu_thread; // see apu_thread.c, NULL when inline
+    struct ppu_thread *ppu_thread; // see ppu_thread.c, NULL when inline
+};
 
 bool cpu_is_iflag(t_nes *);
+uint8_t cpu_get_p(t_cpu *);
+void cpu_set_p(t_cpu *, uint8_t);
 int run_opcode(t_nes *, bool);
+bool cpu_opcode_info(uint8_t, const char **, const char **);
+uint64_t cpu_write_cycle(t_nes *);
+void cpu_run(t_nes *, bool);
 int do_nmi(t_cpu *);
 int do_irq(t_cpu *);
 
+void sched_init(t_nes *);
+void sched_set(t_nes *, int, uint64_t);
+int sched_run(t_nes *);
+
 int ppu_get_x(t_nes *);
 int ppu_get_y(t_nes *);
 
+void ppu_init(t_nes *);
+void ppu_frame_to_argb(const t_nesmu_frame *, void *, int);
 uint8_t ppu_read(t_nes *, uint16_t);
 void ppu_write(t_nes *, uint16_t, uint8_t);
-int ppu_update(t_nes *);
+void ppu_sync(t_nes *);
+void ppu_oam_dma(t_nes *, uint8_t);
+int ppu_event(t_nes *);
+void ppu_replay(t_nes *, int, uint32_t, uint16_t, uint8_t);
+
+// single producer, single consumer ring with blocking waits, see ring.c
+typedef struct ring {
+    void *slots;
+    uint32_t size; // records, a power of two
+    size_t rec_size;
+    atomic_uint read, write;
+    atomic_uint sleepers;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} t_ring;
+
+int ring_init(t_ring *, uint32_t, size_t);
+void ring_destroy(t_ring *);
+void ring_wait(t_ring *, atomic_uint *, uint32_t);
+void ring_wake(t_ring *);
+void ring_push(t_ring *, const void *);
+void ring_flush(t_ring *);
+void ring_pop(t_ring *, void *);
+
+// records sent to the render thread, at a dot of the current frame
+enum ppu_record_kind {
+    PPU_REC_WRITE,     // register write, in order with the drawing
+    PPU_REC_READ,      // PPUSTATUS or PPUDATA read, they move w and v
+    PPU_REC_FRAME,     // the host takes the picture drawn so far
+    PPU_REC_END_FRAME, // on to the next frame
+};
 
+int ppu_thread_start(t_nes *);
+void ppu_thread_stop(t_nes *);
+void ppu_thread_push(t_nes *, int, uint32_t, uint16_t, uint8_t);
+void ppu_thread_end_frame(t_nes *);
+const t_nesmu_frame *ppu_thread_frame(t_nes *);
+
+void apu_init(t_nes *);
 uint8_t apu_read(t_nes *, uint16_t);
 void apu_write(t_nes *, uint16_t, uint8_t);
-int apu_update(t_nes *);
+void apu_sync(t_nes *);
+void apu_frame_event(t_nes *);
+void apu_sync_event(t_nes *);
+void apu_irq_event(t_nes *);
+void apu_set_rate(t_nes *, int32_t);
+
+// records sent to the synthesis thread, at the current cpu cycle
+enum apu_record_kind {
+    APU_REC_WRITE,
+    APU_REC_FRAME_STEP,
+    APU_REC_END_FRAME,
+    APU_REC_RATE,
+};
+
+int apu_thread_start(t_nes *);
+void apu_thread_stop(t_nes *);
+void apu_thread_push(t_nes *, int, uint16_t, uint8_t);
+void apu_thread_set_rate(t_nes *, int32_t);
+void apu_thread_end_frame(t_nes *);
+size_t apu_thread_drain(t_nes *, int16_t *, size_t);
+
+void blip_init(t_blip *, double, double);
+void blip_set_rate(t_blip *, double, double);
+void blip_add_delta(t_blip *, uint32_t, int32_t);
+void blip_end_frame(t_blip *, uint32_t);
+int blip_samples_avail(const t_blip *);
+int blip_read_samples(t_blip *, int32_t *, int);
 
-int shell_open(t_nes *);
-int shell_close(t_nes *);
-int poll_events(t_nes *, int *);
-void audio_enqueue_sample(t_nes *, int16_t);
-int video_write(t_nes *);
+uint8_t cpu_read(void *, uint16_t);
+void cpu_write(void *, uint16_t, uint8_t);
 
 #endif
@@ -0,0 +1,159 @@
+#include "nesmu.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// Per-opcode micro-benchmark (make opbench). Every legal opcode is run
+// in isolation through run_opcode() on a flat 64K RAM bus, so no I/O
+// handler is ever called. The same instruction at $8000 is executed over
+// and over, registers and PC are put back before each run so that every
+// iteration takes the same path. Indexed modes are measured with and
+// without a page crossing, branches taken, with and without one.
+//
+// Reported per opcode and variant: emulated cycles, host ns and host
+// cycles (TSC, x86 only) per emulated instruction. The numbers include
+// the loop below, the same for every row.
+//
+// These are run_opcode() costs, the table dispatch used when tracing.
+// Emulation runs the threaded loop of cpu_run(), which has no indirect
+// call and no per-instruction function overhead, so the absolute
+// numbers are higher than in a real run. Compare opcodes against each
+// other, not against nesmu -b.
+
+#define ITERATIONS 2000000
+#define OPERAND_ZP 0x10
+#define OPERAND_ABS 0x0280 // page crossing when indexed by 0x80 or more
+
+typedef struct variant {
+    const char *name;
+    uint16_t pc;
+    uint8_t x, y;
+} t_variant;
+
+static uint64_t host_cycles(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+static double now_ns(void) {
+    struct timespec ts;
+
+    (void)clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static uint8_t ram_read(void *userdata, uint16_t addr) {
+    return ((t_nes *)userdata)->memory[addr];
+}
+
+static void ram_write(void *userdata, uint16_t addr, uint8_t val) {
+    ((t_nes *)userdata)->memory[addr] = val;
+}
+
+static void ram_bus_init(t_nes *nes) {
+    memset(nes, 0, sizeof(*nes));
+    nes->cpu.userdata = nes;
+    nes->cpu.read = ram_read;
+    nes->cpu.write = ram_write;
+    for (int page = 0; page < 256; page++) {
+        nes->cpu.read_map[page] = nes->memory + (page << 8);
+        nes->cpu.write_map[page] = nes->memory + (page << 8);
+    }
+    sched_init(nes);
+
+    // (zp) and (zp,x) pointers all lead to OPERAND_ABS, so does jmp (abs)
+    for (int i = 0; i < 256; i += 2) {
+        nes->memory[i] = OPERAND_ABS & 0xff;
+        nes->memory[i + 1] = OPERAND_ABS >> 8;
+    }
+    nes->memory[OPERAND_ABS] = OPERAND_ABS & 0xff;
+    nes->memory[OPERAND_ABS + 1] = OPERAND_ABS >> 8;
+}
+
+// run the instruction at v->pc ITERATIONS times, returns emulated cycles
+// of one run and fills in the host cost of one run
+static int measure(t_nes *nes, uint8_t p, const t_variant *v, double *ns,
+                   double *cycles) {
+    t_cpu *cpu = &(nes->cpu);
+    uint64_t start_cycles = 0, emu_cycles = 0;
+    double start_ns = 0;
+
+    for (int i = 0; i < ITERATIONS; i++) {
+        cpu->PC = v->pc;
+        cpu->A = 0x5a;
+        cpu->X = v->x;
+        cpu->Y = v->y;
+        cpu->S = 0xfd;
+        cpu_set_p(cpu, p);
+        if (i == 1) {
+            start_ns = now_ns();
+            start_cycles = host_cycles();
+            emu_cycles = 0;
+        }
+        emu_cycles += run_opcode(nes, false);
+    }
+
+    *ns = (now_ns() - start_ns) / (ITERATIONS - 1);
+    *cycles = (double)(host_cycles() - start_cycles) / (ITERATIONS - 1);
+    return emu_cycles / (ITERATIONS - 1);
+}
+
+int main(void) {
+    static t_nes nes;
+    const t_variant plain = {"", 0x8000, 0x10, 0x10};
+    const t_variant cross = {"+page", 0x8000, 0xa0, 0xa0};
+    const t_variant branch_cross = {"+page", 0x80f0, 0x10, 0x10};
+    const char *name, *mode;
+    double ns, cycles;
+    int emu;
+
+    printf("# per instruction through run_opcode(), the table dispatch\n");
+    printf("%-4s %-5s %-4s %-6s %10s %10s %12s\n", "op", "name", "mode",
+           "var", "emu_cyc", "ns", "host_cyc");
+
+    for (int op = 0; op < 256; op++) {
+        const t_variant *variants[2] = {&plain, NULL};
+        bool is_branch = (op & 0x1f) == 0x10;
+        uint8_t p = 0x24;
+
+        if (!cpu_opcode_info(op, &name, &mode))
+            continue;
+
+        if (!strcmp(mode, "abx") || !strcmp(mode, "aby") ||
+            !strcmp(mode, "idy")) {
+            variants[1] = &cross;
+        }
+
+        if (is_branch) {
+            // bit 5 is the flag value the branch is taken on
+            p = (op & 0x20) ? 0xe7 : 0x24;
+            variants[1] = &branch_cross;
+        }
+
+        for (int i = 0; i < 2 && variants[i]; i++) {
+            const t_variant *v = variants[i];
+
+            ram_bus_init(&nes);
+            nes.memory[v->pc] = op;
+            nes.memory[v->pc + 1] = is_branch ? 0x20 : OPERAND_ZP;
+            nes.memory[v->pc + 2] = is_branch ? 0xea : OPERAND_ABS >> 8;
+            if (!strcmp(mode, "abs") || !strcmp(mode, "abx") ||
+                !strcmp(mode, "aby") || !strcmp(mode, "ind")) {
+                nes.memory[v->pc + 1] = OPERAND_ABS & 0xff;
+            }
+
+            emu = measure(&nes, p, v, &ns, &cycles);
+            printf("0x%02x %-5s %-4s %-6s %10d %10.2f %12.1f\n", op, name,
+                   mode, v->name, emu, ns, cycles);
+        }
+    }
+
+    return 0;
+}
@@ -2,79 +2,831 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
+
+#define VBLANK_SET_DOT (341 * 241 + 1)
+#define VBLANK_CLEAR_DOT (341 * 261 + 1)
+#define VERTICAL_COPY_DOT (341 * 261 + 304) // v = t on the pre-render line
+
+#define SHOW_BG_LEFT 0x02
+#define SHOW_SPRITES_LEFT 0x04
+#define SHOW_BG 0x08
+#define SHOW_SPRITES 0x10
+
+static const uint32_t frame_durations[2] = {341 * 262, 341 * 261 + 340};
+
+// 2C02, ARGB8888
+static const uint32_t nes_palette[64] = {
+    0xff666666, 0xff002a88, 0xff1412a7, 0xff3b00a4, 0xff5c007e, 0xff6e0040,
+    0xff6c0600, 0xff561d00, 0xff333500, 0xff0b4800, 0xff005200, 0xff004f08,
+    0xff00404d, 0xff000000, 0xff000000, 0xff000000, 0xffadadad, 0xff155fd9,
+    0xff4240ff, 0xff7527fe, 0xffa01acc, 0xffb71e7b, 0xffb53120, 0xff994e00,
+    0xff6b6d00, 0xff388700, 0xff0c9300, 0xff008f32, 0xff007c8d, 0xff000000,
+    0xff000000, 0xff000000, 0xfffffeff, 0xff64b0ff, 0xff9290ff, 0xffc676ff,
+    0xfff36aff, 0xfffe6ecc, 0xfffe8170, 0xffea9e22, 0xffbcbe00, 0xff88d800,
+    0xff5ce430, 0xff45e082, 0xff48cdde, 0xff4f4f4f, 0xff000000, 0xff000000,
+    0xfffffeff, 0xffc0dfff, 0xffd3d2ff, 0xffe8c8ff, 0xfffbc2ff, 0xfffec4ea,
+    0xfffeccc5, 0xfff7d8a5, 0xffe4e594, 0xffcfef96, 0xffbdf4ab, 0xffb3f3cc,
+    0xffb5ebf2, 0xffb8b8b8, 0xff000000, 0xff000000,
+};
+
+// the palette under each combination of the emphasis bits: every
+// emphasized color (bit 0 red, 1 green, 2 blue) dims the other two
+#define EMPHASIS_DIM 0.816
+
+static uint32_t argb_palette[8][64];
+
+__attribute__((constructor)) static void build_argb_palette(void) {
+    for (int e = 0; e < 8; e++) {
+        for (int i = 0; i < 64; i++) {
+            uint32_t argb = 0xff000000;
+
+            for (int c = 0; c < 3; c++) {
+                // ARGB keeps red in bits 16-23, blue in bits 0-7
+                double v = (nes_palette[i] >> (16 - 8 * c)) & 0xff;
+
+                if (e && !(e & (1 << c))) {
+                    v *= EMPHASIS_DIM;
+                }
+                argb |= (uint32_t)(v + 0.5) << (16 - 8 * c);
+            }
+            argb_palette[e][i] = argb;
+        }
+    }
+}
+
+static void ppu_clock(t_nes *nes);
+static void ppu_catch_up(t_nes *nes, uint32_t dot);
+static void ppu_predict(t_nes *nes);
+
+// what the render thread has to play to draw the same picture
+static void record(t_nes *nes, int kind, uint32_t dot, uint16_t addr,
+                   uint8_t val) {
+    if (nes->ppu_thread) {
+        ppu_thread_push(nes, kind, dot, addr, val);
+    }
+}
+
+// $3f10/$3f14/$3f18/$3f1c are the backdrop entries of $3f00/$3f04/...
+static uint8_t *palette_entry(t_ppu *ppu, uint16_t addr) {
+    addr &= 0x1f;
+    if ((addr & 0x13) == 0x10) {
+        addr &= ~0x10;
+    }
+    return &ppu->palette[addr];
+}
+
+// $2000-$2fff, and its mirror up to $3eff, on the 2K of the console
+static uint8_t *nametable_entry(t_ppu *ppu, uint16_t addr) {
+    uint16_t table = ppu->vertical_mirroring ? (addr >> 10) & 1
+                                             : (addr >> 11) & 1;
+    return &ppu->nametables[(table << 10) | (addr & 0x3ff)];
+}
+
+// one row of a tile, from its two bitplanes to a byte per pixel
+static void decode_tile_row(t_ppu *ppu, int tile, int row) {
+    uint8_t lo = ppu->chr[tile * 16 + row];
+    uint8_t hi = ppu->chr[tile * 16 + row + 8];
+    uint8_t *out = &ppu->tiles[tile][row * 8];
+
+    for (int i = 0; i < 8; i++) {
+        out[i] = ((lo >> (7 - i)) & 1) | (((hi >> (7 - i)) & 1) << 1);
+    }
+}
+
+// OAM is kept as four arrays of 64, y, tile, attributes and x, byte n of
+// sprite i is at OAMADDR i * 4 + n
+static uint8_t *oam_entry(t_ppu *ppu, uint8_t addr) {
+    return &ppu->oam[addr & 3][addr >> 2];
+}
+
+static uint8_t vram_read(t_ppu *ppu, uint16_t addr) {
+    addr &= 0x3fff;
+    if (addr < 0x2000) {
+        return ppu->chr[addr];
+    } else if (addr < 0x3f00) {
+        return *nametable_entry(ppu, addr);
+    }
+    return *palette_entry(ppu, addr);
+}
+
+// the tile cache follows CHR RAM writes, a row at a time
+static void vram_write(t_ppu *ppu, uint16_t addr, uint8_t val) {
+    addr &= 0x3fff;
+    if (addr < 0x2000) {
+        if (ppu->chr_ram) {
+            ppu->chr[addr] = val;
+            decode_tile_row(ppu, addr >> 4, addr & 7);
+        }
+    } else if (addr < 0x3f00) {
+        *nametable_entry(ppu, addr) = val;
+    } else {
+        *palette_entry(ppu, addr) = val & 0x3f;
+    }
+}
+
+static uint8_t ppu_status(t_nes *nes) {
+    uint32_t dot = nes->ppu_cycles;
+    uint8_t status = nes->ppu_registers[2] & 0x1f;
+
+    status |= nes->NMI_occurred << 7;
+    if (dot < VBLANK_CLEAR_DOT) {
+        status |= (nes->ppu.predicted_hit <= dot) ? 64 : 0;
+        status |= (nes->ppu.predicted_overflow <= dot) ? 32 : 0;
+    }
+    return status;
+}
+
+static uint8_t ppu_register_read(t_nes *nes, uint16_t addr) {
+    t_ppu *ppu = &(nes->ppu);
+    uint8_t val;
 
-uint8_t ppu_read(t_nes *nes, uint16_t addr) {
     switch (addr) {
     case PPUSTATUS:
-        nes->ppu_registers[addr & 7] &= ~128;
-        nes->ppu_registers[addr & 7] |= (nes->NMI_occurred << 7);
+        nes->ppu_registers[addr & 7] = ppu_status(nes);
         nes->NMI_occurred = false;
+        nes->NMI_line_status = false;
+        ppu->w = false;
         return nes->ppu_registers[addr & 7];
 
+    case OAMDATA:
+        return *oam_entry(ppu, nes->ppu_registers[OAMADDR & 7]);
+
+    case PPUDATA:
+        // palette reads are not delayed, the buffer gets the nametable
+        // byte underneath
+        val = ppu->read_buffer;
+        ppu->read_buffer = vram_read(ppu, ppu->v);
+        if ((ppu->v & 0x3fff) >= 0x3f00) {
+            val = ppu->read_buffer;
+            ppu->read_buffer = vram_read(ppu, ppu->v - 0x1000);
+        }
+        ppu->v += (nes->ppu_registers[0] & 4) ? 32 : 1;
+        return val;
+
     case PPUCTRL:
     case PPUMASK:
     case OAMADDR:
-    case OAMDATA:
     case PPUSCROLL:
     case PPUADDR:
-    case PPUDATA:
         return nes->ppu_registers[addr & 7];
     default:
         return 0;
     }
 }
 
-void ppu_write(t_nes *nes, uint16_t addr, uint8_t val) {
+// PPUSTATUS polls are answered from the prediction, the picture is only
+// drawn up to the current dot when there is none
+uint8_t ppu_read(t_nes *nes, uint16_t addr) {
+    uint8_t val;
+
+    if (addr == PPUSTATUS) {
+        ppu_clock(nes);
+        if (!nes->ppu.predicted) {
+            ppu_catch_up(nes, nes->ppu_cycles);
+            ppu_predict(nes);
+        }
+    } else {
+        ppu_sync(nes);
+    }
+
+    // both move the scroll registers
+    if ((addr == PPUSTATUS && nes->ppu.w) || addr == PPUDATA) {
+        record(nes, PPU_REC_READ, nes->ppu_cycles, addr, 0);
+    }
+    val = ppu_register_read(nes, addr);
+    if (addr == PPUDATA) {
+        nes->ppu.predicted = false;
+    }
+    return val;
+}
+
+// the effect of a write on the picture, in order with the drawing
+static void ppu_register_write(t_nes *nes, uint16_t addr, uint8_t val) {
+    t_ppu *ppu = &(nes->ppu);
+
     switch (addr) {
     case PPUCTRL:
         nes->ppu_registers[addr & 7] = val;
-        nes->NMI_output = (val & 128) ? true : false;
+        ppu->t = (ppu->t & 0xf3ff) | ((val & 3) << 10);
+        break;
+    case OAMDATA:
+        *oam_entry(ppu, nes->ppu_registers[OAMADDR & 7]++) = val;
+        break;
+    case PPUSCROLL:
+        if (!ppu->w) {
+            ppu->t = (ppu->t & 0xffe0) | (val >> 3);
+            ppu->x = val & 7;
+        } else {
+            ppu->t = (ppu->t & 0x8c1f) | ((val & 7) << 12) |
+                     ((val & 0xf8) << 2);
+        }
+        ppu->w = !ppu->w;
+        break;
+    case PPUADDR:
+        if (!ppu->w) {
+            ppu->t = (ppu->t & 0x00ff) | ((val & 0x3f) << 8);
+        } else {
+            ppu->t = (ppu->t & 0xff00) | val;
+            ppu->v = ppu->t;
+        }
+        ppu->w = !ppu->w;
+        break;
+    case PPUDATA:
+        vram_write(ppu, ppu->v, val);
+        ppu->v += (nes->ppu_registers[0] & 4) ? 32 : 1;
         break;
     case PPUMASK:
     case PPUSTATUS:
     case OAMADDR:
-    case OAMDATA:
+        nes->ppu_registers[addr & 7] = val;
+        break;
+    default:
+    }
+}
+
+// PPUCTRL, PPUMASK, PPUSCROLL, PPUADDR and PPUDATA writes are only
+// logged with their dot, drawing catches up with them later. Nothing the
+// cpu reads depends on them but the NMI enable, which is taken at once.
+void ppu_write(t_nes *nes, uint16_t addr, uint8_t val) {
+    t_ppu *ppu = &(nes->ppu);
+
+    switch (addr) {
+    case PPUCTRL:
+    case PPUMASK:
     case PPUSCROLL:
     case PPUADDR:
     case PPUDATA:
-        nes->ppu_registers[addr & 7] = val;
+        ppu_clock(nes);
+        ppu->predicted = false;
+        if (ppu->num_writes == PPU_WRITE_LOG) {
+            ppu_catch_up(nes, nes->ppu_cycles);
+        }
+        ppu->writes[ppu->num_writes].dot = nes->ppu_cycles;
+        ppu->writes[ppu->num_writes].addr = addr;
+        ppu->writes[ppu->num_writes].val = val;
+        ppu->num_writes += 1;
         break;
     default:
+        // what was drawn so far used the old values
+        ppu_sync(nes);
+        ppu_register_write(nes, addr, val);
+        ppu->predicted = false;
+        record(nes, PPU_REC_WRITE, nes->ppu_cycles, addr, val);
+        return;
+    }
+
+    if (addr == PPUCTRL) {
+        nes->NMI_output = (val & 128) ? true : false;
+        // NMI edge is taken on the next instruction boundary
+        if (nes->NMI_occurred && nes->NMI_output) {
+            sched_set(nes, EV_PPU, nes->cpu.cycles);
+        } else {
+            nes->NMI_line_status = false;
+        }
+    }
+}
+
+// $4014: the page goes to OAM from OAMADDR on, all 256 bytes at once
+// and straight from memory when the page is plain memory. The cpu is
+// halted for 513 cycles, 514 when the write lands on an odd cycle. That
+// is the last cycle of the store, its parity depends on the addressing
+// mode (STA abs writes on its 4th cycle, STA abs,X on its 5th).
+void ppu_oam_dma(t_nes *nes, uint8_t page) {
+    t_ppu *ppu = &(nes->ppu);
+    const uint8_t *src = nes->cpu.read_map[page];
+    uint8_t addr = nes->ppu_registers[OAMADDR & 7], buf[256];
+
+    if (!src) {
+        for (int i = 0; i < 256; i++) {
+            buf[i] = cpu_read(nes, (page << 8) | i);
+        }
+        src = buf;
+    }
+
+    // sprites of the lines drawn so far came from the old OAM
+    ppu_sync(nes);
+    for (int i = 0; i < 256; i++) {
+        *oam_entry(ppu, addr + i) = src[i];
+        record(nes, PPU_REC_WRITE, nes->ppu_cycles, OAMDATA, src[i]);
+    }
+    ppu->predicted = false;
+
+    nes->cpu.dmc_halt_cycles += 513 + (cpu_write_cycle(nes) & 1);
+    nes->cpu.deadline = 0; // cpu_run() takes the stall
+}
+
+// Rendering is done a whole scanline at a time, when the PPU reaches the
+// start of the line: register writes made up to then, usually during
+// the horizontal blank before, show on it. Drawing is lazy, it only
+// catches up when a register is read, on the vblank event, at the end of
+// a frame or when the write log is full. Logged writes are replayed in
+// between the lines they fall on, so mid-frame changes of scroll,
+// pattern tables or palette still land on the right line, and a frame
+// without reads during rendering is drawn in one go at vblank.
+//
+// Sprites are looked up for the next line once a line is drawn, as the
+// PPU does. A sprite 0 hit or an overflow is recorded as the dot it
+// happens on. PPUSTATUS compares the current dot to the dots predicted
+// for the frame (ppu_predict()), so polling it draws nothing.
+
+static void fetch_background(t_nes *nes, uint8_t *line) {
+    t_ppu *ppu = &(nes->ppu);
+    uint16_t v = ppu->v;
+    uint16_t table = (nes->ppu_registers[0] & 0x10) ? 256 : 0;
+    int fine_y = (v >> 12) & 7;
+
+    // 33 tiles cover 256 pixels at any fine x, 8 pixels per fetch
+    for (int i = 0; i < 33; i++) {
+        uint16_t nt_addr = 0x2000 | (v & 0x0fff);
+        uint16_t at_addr =
+            0x23c0 | (v & 0x0c00) | ((v >> 4) & 0x38) | ((v >> 2) & 7);
+        int shift = ((v >> 4) & 4) | (v & 2);
+        uint8_t attr = ((*nametable_entry(ppu, at_addr) >> shift) & 3) << 2;
+        const uint8_t *row =
+            &ppu->tiles[table + *nametable_entry(ppu, nt_addr)][fine_y * 8];
+        uint64_t pixels, opaque;
+
+        // the attribute goes on the 8 pixels at once, but the clear ones
+        memcpy(&pixels, row, 8);
+        opaque = ((pixels | (pixels >> 1)) & 0x0101010101010101) * 0xff;
+        pixels |= opaque & (attr * 0x0101010101010101);
+        memcpy(line + i * 8, &pixels, 8);
+
+        // coarse x increment, into the next nametable after 32 tiles
+        if ((v & 0x1f) == 31) {
+            v = (v & ~0x1f) ^ 0x0400;
+        } else {
+            v += 1;
+        }
     }
 }
 
-int ppu_get_x(t_nes *nes) { return nes->ppu_cycles % 341; }
-int ppu_get_y(t_nes *nes) { return nes->ppu_cycles / 341; }
+// sprite pixels of a line: palette index 0x10-0x1f, 0 when transparent,
+// bit 6 for behind the background and bit 7 for sprite 0
+static void fetch_sprites(t_nes *nes, int y, uint8_t *line) {
+    t_ppu *ppu = &(nes->ppu);
+    uint8_t ctrl = nes->ppu_registers[0];
+    int height = (ctrl & 0x20) ? 16 : 8;
+
+    for (int i = 0; i < ppu->num_sprites; i++) {
+        int n = ppu->sprites[i];
+        int row = y - 1 - ppu->oam[OAM_Y][n], tile = ppu->oam[OAM_TILE][n];
+        int left = ppu->oam[OAM_X][n];
+        uint8_t attr = ppu->oam[OAM_ATTR][n], flags;
+        const uint8_t *pixels;
+
+        row = (attr & 0x80) ? height - 1 - row : row;
+        if (height == 16) {
+            tile = ((tile & 1) << 8) | (tile & 0xfe);
+            tile += (row >= 8) ? 1 : 0;
+        } else {
+            tile |= (ctrl & 0x08) ? 256 : 0;
+        }
+        pixels = &ppu->tiles[tile][(row & 7) * 8];
+
+        flags = 0x10 | ((attr & 3) << 2) | ((attr & 0x20) << 1);
+        flags |= (n == 0) ? 0x80 : 0;
+
+        // the first sprite in OAM order wins, whatever its priority
+        for (int j = 0; j < 8 && left + j < NESMU_WIDTH; j++) {
+            uint8_t p = pixels[(attr & 0x40) ? 7 - j : j];
+
+            if (p && !line[left + j]) {
+                line[left + j] = flags | p;
+            }
+        }
+    }
+}
+
+// Sprite evaluation: a bit per sprite whose rows cover line y, that is
+// y - height < oam y <= y. With SSE2 the 64 y bytes are compared 16 at a
+// time with unsigned saturating subtractions.
+#ifdef __SSE2__
+static uint64_t sprites_on_line(const t_ppu *ppu, int y, int height) {
+    const __m128i line = _mm_set1_epi8((char)y);
+    const __m128i last_row = _mm_set1_epi8((char)(height - 1));
+    uint64_t found = 0;
+
+    for (int i = 0; i < 64; i += 16) {
+        __m128i top = _mm_loadu_si128((const __m128i *)&ppu->oam[OAM_Y][i]);
+        __m128i below = _mm_subs_epu8(top, line); // 0 when top <= y
+        __m128i row = _mm_subs_epu8(_mm_sub_epi8(line, top), last_row);
+        __m128i in = _mm_cmpeq_epi8(_mm_or_si128(below, row),
+                                    _mm_setzero_si128());
+
+        found |= (uint64_t)(uint16_t)_mm_movemask_epi8(in) << i;
+    }
+    return found;
+}
+#else
+static uint64_t sprites_on_line(const t_ppu *ppu, int y, int height) {
+    uint64_t found = 0;
+
+    for (int i = 0; i < 64; i++) {
+        int row = y - ppu->oam[OAM_Y][i];
+
+        found |= (uint64_t)(row >= 0 && row < height) << i;
+    }
+    return found;
+}
+#endif
+
+// the sprites on line y + 1, found while line y is drawn
+static void evaluate_sprites(t_nes *nes, int y) {
+    t_ppu *ppu = &(nes->ppu);
+    int height = (nes->ppu_registers[0] & 0x20) ? 16 : 8;
+    uint64_t found = sprites_on_line(ppu, y, height);
+
+    ppu->num_sprites = 0;
+    while (found && ppu->num_sprites < PPU_LINE_SPRITES) {
+        ppu->sprites[ppu->num_sprites++] = __builtin_ctzll(found);
+        found &= found - 1;
+    }
+
+    if (found && ppu->overflow_dot == UINT32_MAX) {
+        ppu->overflow_dot = y * 341 + 256;
+    }
+}
+
+// Compositing: a sprite pixel shows over a transparent background, or
+// over any when it is in front. Returns the x of the first sprite 0 hit,
+// -1 if there is none. There is never one on x = 255.
+#ifdef __SSE2__
+static int composite_line(const uint8_t *bg, const uint8_t *spr,
+                          uint8_t *index) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i behind = _mm_set1_epi8(0x40);
+    const __m128i sprite_index = _mm_set1_epi8(0x1f);
+    int hit = -1;
+
+    for (int x = 0; x < NESMU_WIDTH; x += 16) {
+        __m128i b = _mm_loadu_si128((const __m128i *)(bg + x));
+        __m128i s = _mm_loadu_si128((const __m128i *)(spr + x));
+        __m128i b_clear = _mm_cmpeq_epi8(b, zero);
+        __m128i front = _mm_cmpeq_epi8(_mm_and_si128(s, behind), zero);
+        __m128i show = _mm_andnot_si128(_mm_cmpeq_epi8(s, zero),
+                                        _mm_or_si128(b_clear, front));
+        __m128i p = _mm_or_si128(
+            _mm_and_si128(show, _mm_and_si128(s, sprite_index)),
+            _mm_andnot_si128(show, b));
+
+        _mm_storeu_si128((__m128i *)(index + x), p);
+
+        // bit 7 of a sprite pixel is sprite 0
+        if (hit < 0) {
+            int hits = _mm_movemask_epi8(s) & ~_mm_movemask_epi8(b_clear);
+
+            hits &= (x == NESMU_WIDTH - 16) ? 0x7fff : 0xffff;
+            hit = hits ? x + __builtin_ctz(hits) : -1;
+        }
+    }
+    return hit;
+}
+#else
+static int composite_line(const uint8_t *bg, const uint8_t *spr,
+                          uint8_t *index) {
+    int hit = -1;
+
+    for (int x = 0; x < NESMU_WIDTH; x++) {
+        uint8_t b = bg[x], s = spr[x];
+
+        index[x] = (s && (!b || !(s & 0x40))) ? s & 0x1f : b;
+        if (hit < 0 && (s & 0x80) && b && x != NESMU_WIDTH - 1) {
+            hit = x;
+        }
+    }
+    return hit;
+}
+#endif
+
+// background and sprites of line y, composited into out, or only looked
+// at for a sprite 0 hit when out is NULL
+static void draw_line(t_nes *nes, int y, uint8_t *out) {
+    t_ppu *ppu = &(nes->ppu);
+    uint8_t mask = nes->ppu_registers[1];
+    uint8_t grey = (mask & 1) ? 0x30 : 0x3f;
+    uint8_t bg[33 * 8], spr[NESMU_WIDTH], index[NESMU_WIDTH], colors[32];
+    int hit;
+
+    memset(bg, 0, sizeof(bg));
+    memset(spr, 0, sizeof(spr));
+    if (mask & SHOW_BG) {
+        fetch_background(nes, bg);
+        if (!(mask & SHOW_BG_LEFT)) {
+            memset(bg + ppu->x, 0, 8);
+        }
+    }
+    if (mask & SHOW_SPRITES) {
+        fetch_sprites(nes, y, spr);
+        if (!(mask & SHOW_SPRITES_LEFT)) {
+            memset(spr, 0, 8);
+        }
+    }
+
+    hit = composite_line(bg + ppu->x, spr, index);
+    if (hit >= 0 && ppu->hit_dot == UINT32_MAX) {
+        ppu->hit_dot = y * 341 + hit + 1;
+    }
+
+    if (out) {
+        for (int i = 0; i < 32; i++) {
+            colors[i] = *palette_entry(ppu, i) & grey;
+        }
+        for (int x = 0; x < NESMU_WIDTH; x++) {
+            out[x] = colors[index[x]];
+        }
+    }
+}
+
+// A silent PPU (the picture is drawn on the render thread, or this is a
+// prediction) keeps the scroll registers and sprite evaluation going, and
+// only looks at the lines sprite 0 could hit on.
+static void render_line(t_nes *nes, int y) {
+    t_ppu *ppu = &(nes->ppu);
+    uint8_t mask = nes->ppu_registers[1];
+    bool hit_test = ppu->num_sprites && ppu->sprites[0] == 0 &&
+                    ppu->hit_dot == UINT32_MAX;
+
+    if (!(mask & (SHOW_BG | SHOW_SPRITES))) {
+        if (!ppu->silent) {
+            nes->frame.emphasis[y] = mask >> 5;
+            memset(nes->frame.pixels + y * NESMU_WIDTH,
+                   ppu->palette[0] & ((mask & 1) ? 0x30 : 0x3f), NESMU_WIDTH);
+        }
+        ppu->num_sprites = 0;
+        return;
+    }
+
+    // horizontal scroll bits are reloaded from t at the end of a line
+    ppu->v = (ppu->v & ~0x041f) | (ppu->t & 0x041f);
+
+    if (!ppu->silent) {
+        nes->frame.emphasis[y] = mask >> 5;
+        draw_line(nes, y, nes->frame.pixels + y * NESMU_WIDTH);
+    } else if (hit_test) {
+        draw_line(nes, y, NULL);
+    }
+    evaluate_sprites(nes, y);
+
+    // fine y increment, then coarse y, into the next nametable at row 30
+    if ((ppu->v & 0x7000) != 0x7000) {
+        ppu->v += 0x1000;
+    } else {
+        int coarse_y = (ppu->v >> 5) & 31;
+
+        ppu->v &= ~0x7000;
+        if (coarse_y == 29) {
+            coarse_y = 0;
+            ppu->v ^= 0x0800;
+        } else if (coarse_y == 31) {
+            coarse_y = 0;
+        } else {
+            coarse_y += 1;
+        }
+        ppu->v = (ppu->v & ~0x03e0) | (coarse_y << 5);
+    }
+}
+
+// draw every line that starts at or before dot
+static void ppu_render(t_nes *nes, uint32_t dot) {
+    t_ppu *ppu = &(nes->ppu);
+
+    while (ppu->line < NESMU_HEIGHT && (uint32_t)ppu->line * 341 <= dot) {
+        render_line(nes, ppu->line);
+        ppu->line += 1;
+    }
+
+    if (ppu->line == NESMU_HEIGHT && VERTICAL_COPY_DOT <= dot) {
+        if (nes->ppu_registers[1] & (SHOW_BG | SHOW_SPRITES)) {
+            ppu->v = ppu->t;
+        }
+        ppu->num_sprites = 0; // nothing is drawn on line 0
+        ppu->line += 1;
+    }
+}
+
+// Frame conversion. A line has one emphasis, so each of its pixels is a
+// lookup in the same 64 entry table: 8 at a time with an AVX2 gather, 4
+// at a time on SSE2, where the lookups are scalar but the stores are not.
+
+typedef void (*t_convert_line)(const uint8_t *, const uint32_t *,
+                               uint32_t *);
+
+static void convert_line(const uint8_t *src, const uint32_t *table,
+                         uint32_t *dst) {
+    for (int x = 0; x < NESMU_WIDTH; x++) {
+        dst[x] = table[src[x]];
+    }
+}
+
+#ifdef __SSE2__
+static void convert_line_sse2(const uint8_t *src, const uint32_t *table,
+                              uint32_t *dst) {
+    for (int x = 0; x < NESMU_WIDTH; x += 4) {
+        __m128i p = _mm_set_epi32(table[src[x + 3]], table[src[x + 2]],
+                                  table[src[x + 1]], table[src[x]]);
+
+        _mm_storeu_si128((__m128i *)(dst + x), p);
+    }
+}
+
+__attribute__((target("avx2"))) static void
+convert_line_avx2(const uint8_t *src, const uint32_t *table, uint32_t *dst) {
+    for (int x = 0; x < NESMU_WIDTH; x += 8) {
+        __m128i i8 = _mm_loadl_epi64((const __m128i *)(src + x));
+        __m256i p = _mm256_i32gather_epi32((const int *)table,
+                                           _mm256_cvtepu8_epi32(i8), 4);
+
+        _mm256_storeu_si256((__m256i *)(dst + x), p);
+    }
+}
+#endif
+
+static t_convert_line convert = convert_line;
+
+__attribute__((constructor)) static void pick_convert_line(void) {
+#ifdef __SSE2__
+    __builtin_cpu_init();
+    convert = __builtin_cpu_supports("avx2") ? convert_line_avx2
+                                             : convert_line_sse2;
+#endif
+}
+
+// pixels are palette indices below 64, as written by render_line()
+void ppu_frame_to_argb(const t_nesmu_frame *frame, void *dst, int pitch) {
+    for (int y = 0; y < NESMU_HEIGHT; y++) {
+        convert(frame->pixels + y * NESMU_WIDTH,
+                argb_palette[frame->emphasis[y] & 7],
+                (uint32_t *)((uint8_t *)dst + y * pitch));
+    }
+}
+
+static void ppu_end_frame(t_nes *nes) {
+    nes->ppu.line = 0;
+    nes->ppu.hit_dot = UINT32_MAX;
+    nes->ppu.overflow_dot = UINT32_MAX;
+    nes->ppu.predicted = false;
+}
+
+// The sprite 0 hit and overflow dots of the whole frame, as they will be
+// if no register is written until its end: the lines left are run
+// silent, which only draws those sprite 0 is on, and everything but the
+// two dots is put back. Any write or PPUDATA read drops the prediction,
+// it is made again on the next PPUSTATUS read.
+static void ppu_predict(t_nes *nes) {
+    t_ppu *ppu = &(nes->ppu);
+    uint16_t v = ppu->v;
+    int line = ppu->line, num_sprites = ppu->num_sprites;
+    uint8_t sprites[PPU_LINE_SPRITES];
+    uint32_t hit_dot = ppu->hit_dot, overflow_dot = ppu->overflow_dot;
+    bool silent = ppu->silent;
+
+    memcpy(sprites, ppu->sprites, sizeof(sprites));
+    ppu->silent = true;
+    ppu_render(nes, (NESMU_HEIGHT - 1) * 341);
+
+    ppu->predicted_hit = ppu->hit_dot;
+    ppu->predicted_overflow = ppu->overflow_dot;
+    ppu->predicted = true;
+
+    ppu->v = v;
+    ppu->line = line;
+    ppu->num_sprites = num_sprites;
+    memcpy(ppu->sprites, sprites, sizeof(sprites));
+    ppu->hit_dot = hit_dot;
+    ppu->overflow_dot = overflow_dot;
+    ppu->silent = silent;
+
+    // drawing catches up when the hit comes, not later at vblank
+    if (ppu->predicted_hit != UINT32_MAX &&
+        ppu->predicted_hit > nes->ppu_cycles) {
+        uint64_t when = nes->cpu.cycles +
+                        (ppu->predicted_hit - nes->ppu_cycles + 2) / 3;
+
+        if (when < nes->sched.when[EV_PPU]) {
+            sched_set(nes, EV_PPU, when);
+        }
+    }
+}
+
+// draw up to dot, the logged writes going in between the lines
+static void ppu_catch_up(t_nes *nes, uint32_t dot) {
+    t_ppu *ppu = &(nes->ppu);
+
+    for (int i = 0; i < ppu->num_writes; i++) {
+        ppu_render(nes, ppu->writes[i].dot);
+        ppu_register_write(nes, ppu->writes[i].addr, ppu->writes[i].val);
+        record(nes, PPU_REC_WRITE, ppu->writes[i].dot, ppu->writes[i].addr,
+               ppu->writes[i].val);
+    }
+    ppu->num_writes = 0;
+    ppu_render(nes, dot);
+}
+
+// bring ppu_cycles up to the current cpu cycle. The picture is left
+// behind, unless a frame ends on the way.
+static void ppu_clock(t_nes *nes) {
+    uint64_t new_cpu_cycles = nes->cpu.cycles - nes->ppu_sync_cycles;
+
+    nes->ppu_sync_cycles = nes->cpu.cycles;
+    nes->ppu_cycles += 3 * new_cpu_cycles;
+    while (frame_durations[nes->parity] <= nes->ppu_cycles) {
+        ppu_catch_up(nes, UINT32_MAX);
+        ppu_end_frame(nes);
+        record(nes, PPU_REC_END_FRAME, UINT32_MAX, 0, 0);
+
+        nes->ppu_cycles -= frame_durations[nes->parity];
+        nes->parity ^= 1;
+        nes->frame_number += 1;
+    }
+}
+
+// bring ppu_cycles up to the current cpu cycle, and the picture with it
+void ppu_sync(t_nes *nes) {
+    ppu_clock(nes);
+    ppu_catch_up(nes, nes->ppu_cycles);
+}
+
+// render thread: draw up to dot, then play the record
+void ppu_replay(t_nes *nes, int kind, uint32_t dot, uint16_t addr,
+                uint8_t val) {
+    ppu_render(nes, dot);
+    switch (kind) {
+    case PPU_REC_WRITE:
+        ppu_register_write(nes, addr, val);
+        break;
+    case PPU_REC_READ:
+        (void)ppu_register_read(nes, addr);
+        break;
+    case PPU_REC_END_FRAME:
+        ppu_end_frame(nes);
+        break;
+    default:
+    }
+}
+
+int ppu_get_x(t_nes *nes) {
+    ppu_clock(nes);
+    return nes->ppu_cycles % 341;
+}
+
+int ppu_get_y(t_nes *nes) {
+    ppu_clock(nes);
+    return nes->ppu_cycles / 341;
+}
 
 #define IS_VBLANK (nes->ppu_registers[2] & 128)
 #define SET_VBLANK (nes->ppu_registers[2] |= 128)
 #define CLEAR_VBLANK (nes->ppu_registers[2] &= ~128)
 #define UPDATE_VBLANK(val) ((val) ? (SET_VBLANK) : (CLEAR_VBLANK))
 
-int ppu_update(t_nes *nes) {
-    uint32_t frame_durations[2] = {341 * 262, 341 * 261 + 340};
-    uint32_t new_cpu_cycles, new_ppu_cycles, x, y;
-    int retval = 0;
+static void schedule_next(t_nes *nes) {
+    uint32_t dot = nes->ppu_cycles, target;
 
-    new_cpu_cycles = nes->cpu.cycles - nes->prev_cpu_cycles;
-    new_ppu_cycles = 3 * new_cpu_cycles;
-    nes->ppu_cycles += new_ppu_cycles;
-    if (frame_durations[nes->parity] <= nes->ppu_cycles) {
-        nes->ppu_cycles %= frame_durations[nes->parity];
-        nes->parity ^= 1;
-        nes->frame_number += 1;
+    if (dot < VBLANK_SET_DOT) {
+        target = VBLANK_SET_DOT;
+    } else if (dot < VBLANK_CLEAR_DOT) {
+        target = VBLANK_CLEAR_DOT;
+    } else {
+        target = frame_durations[nes->parity] + VBLANK_SET_DOT;
     }
 
-    y = ppu_get_y(nes);
-    x = ppu_get_x(nes);
+    sched_set(nes, EV_PPU, nes->cpu.cycles + (target - dot + 2) / 3);
+}
+
+// the tile cache starts out with whatever CHR the cartridge came with
+void ppu_init(t_nes *nes) {
+    for (int tile = 0; tile < 512; tile++) {
+        for (int row = 0; row < 8; row++) {
+            decode_tile_row(&(nes->ppu), tile, row);
+        }
+    }
+    nes->ppu.hit_dot = UINT32_MAX;
+    nes->ppu.overflow_dot = UINT32_MAX;
+
+    nes->ppu_sync_cycles = 0;
+    sched_set(nes, EV_PPU, nes->cpu.cycles);
+}
+
+int ppu_event(t_nes *nes) {
+    bool in_vblank;
+    int retval = 0;
+
+    ppu_sync(nes);
+    in_vblank = (VBLANK_SET_DOT <= nes->ppu_cycles) &&
+                (nes->ppu_cycles < VBLANK_CLEAR_DOT);
 
-    if ((!IS_VBLANK) && (241 == y) && (1 <= x)) {
+    if ((!IS_VBLANK) && in_vblank) {
         UPDATE_VBLANK(true);
         nes->NMI_occurred = true;
         retval = 1;
     }
 
-    if ((IS_VBLANK) && (261 == y) && (1 <= x)) {
+    if ((IS_VBLANK) && !in_vblank) {
         UPDATE_VBLANK(false);
         nes->NMI_occurred = false;
     }
@@ -84,7 +836,9 @@ int ppu_update(t_nes *nes) {
 
     if (!nes->NMI_line_status_old && nes->NMI_line_status) {
         nes->cpu.cycles += do_nmi(&(nes->cpu));
+        ppu_sync(nes);
     }
 
+    schedule_next(nes);
     return retval;
 }
@@ -0,0 +1,154 @@
+#include "nesmu.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Drawing on a thread of its own (nesmu_set_video_thread()).
+//
+// The main thread keeps running the PPU with ppu.silent set: the scroll
+// registers, sprite evaluation and the lines sprite 0 could hit on are
+// still worked out there, so PPUSTATUS reads get their vblank, sprite 0
+// hit and overflow bits right away. Every register write, and the reads
+// that move v or w, are also sent with their dot to a second t_nes owned
+// by the render thread, which plays them through the very same
+// ppu_register_write() and draws the lines in between. Both see the same
+// inputs at the same dots, so the pictures are the ones the inline PPU
+// would have drawn.
+//
+// Records go through a single producer, single consumer ring (ring.c),
+// the render thread sleeps while it is empty. At vblank the main thread asks for the frame drawn so far
+// and waits for the frame before it: the render thread draws frame N
+// while the cpu runs frame N + 1. Finished frames are copied out to two
+// slots, one for the host to read and one for the render thread to fill.
+
+#define QUEUE_SIZE 8192 // records, a power of two
+
+enum { PPU_REC_STOP = PPU_REC_END_FRAME + 1 };
+
+typedef struct ppu_record {
+    uint32_t dot;
+    uint16_t addr;
+    uint8_t val;
+    uint8_t kind;
+} t_ppu_record;
+
+struct ppu_thread {
+    pthread_t thread;
+    t_nes *render; // only its PPU and frame are used
+    uint32_t frames_sent;
+
+    t_ring queue;
+
+    t_nesmu_frame frames[2];
+    atomic_uint frames_done;
+};
+
+static void *render_main(void *arg) {
+    struct ppu_thread *t = arg;
+    t_nes *render = t->render;
+    t_ppu_record rec;
+    uint32_t done;
+
+    for (;;) {
+        ring_pop(&t->queue, &rec);
+        ppu_replay(render, rec.kind, rec.dot, rec.addr, rec.val);
+        switch (rec.kind) {
+        case PPU_REC_FRAME:
+            done = atomic_load_explicit(&t->frames_done, memory_order_relaxed);
+            t->frames[done & 1] = render->frame;
+            atomic_store(&t->frames_done, done + 1);
+            ring_wake(&t->queue);
+            break;
+        case PPU_REC_STOP:
+            return NULL;
+        default:
+        }
+    }
+}
+
+// main thread. Records are never dropped, if drawing is that far behind
+// the emulation waits for it. The render thread is only woken up for a
+// frame, or when the ring fills up.
+void ppu_thread_push(t_nes *nes, int kind, uint32_t dot, uint16_t addr,
+                     uint8_t val) {
+    struct ppu_thread *t = nes->ppu_thread;
+    t_ppu_record rec = {dot, addr, val, kind};
+
+    ring_push(&t->queue, &rec);
+    if (kind == PPU_REC_FRAME || kind == PPU_REC_STOP) {
+        ring_flush(&t->queue);
+    }
+}
+
+// hand the picture over and wait until the previous one is drawn
+void ppu_thread_end_frame(t_nes *nes) {
+    struct ppu_thread *t = nes->ppu_thread;
+    uint32_t done;
+
+    ppu_sync(nes);
+    ppu_thread_push(nes, PPU_REC_FRAME, nes->ppu_cycles, 0, 0);
+    t->frames_sent += 1;
+    while ((done = atomic_load(&t->frames_done)) + 1 < t->frames_sent) {
+        ring_wait(&t->queue, &t->frames_done, done);
+    }
+}
+
+// the frame before the last one handed over, both slots start out with
+// the picture as it was when the thread was started
+const t_nesmu_frame *ppu_thread_frame(t_nes *nes) {
+    struct ppu_thread *t = nes->ppu_thread;
+
+    return &t->frames[(t->frames_sent - 2) & 1];
+}
+
+// the render thread takes over the state of the inline PPU
+int ppu_thread_start(t_nes *nes) {
+    struct ppu_thread *t = calloc(1, sizeof(*t));
+
+    if (!t) {
+        return 1;
+    }
+    t->render = calloc(1, sizeof(t_nes));
+    if (!t->render || ring_init(&t->queue, QUEUE_SIZE, sizeof(t_ppu_record))) {
+        free(t->render);
+        free(t);
+        return 1;
+    }
+
+    ppu_sync(nes);
+    t->render->ppu = nes->ppu;
+    memcpy(t->render->ppu_registers, nes->ppu_registers,
+           sizeof(nes->ppu_registers));
+    t->render->frame = nes->frame;
+    t->frames[0] = nes->frame;
+    t->frames[1] = nes->frame;
+
+    if (pthread_create(&t->thread, NULL, render_main, t) != 0) {
+        ring_destroy(&t->queue);
+        free(t->render);
+        free(t);
+        return 1;
+    }
+
+    nes->ppu.silent = true;
+    nes->ppu_thread = t;
+    return 0;
+}
+
+// draw up to the current dot, the inline PPU goes on from that picture
+void ppu_thread_stop(t_nes *nes) {
+    struct ppu_thread *t = nes->ppu_thread;
+
+    ppu_sync(nes);
+    ppu_thread_push(nes, PPU_REC_STOP, nes->ppu_cycles, 0, 0);
+    pthread_join(t->thread, NULL);
+
+    nes->frame = t->render->frame;
+    nes->ppu.silent = false;
+    nes->ppu_thread = NULL;
+
+    ring_destroy(&t->queue);
+    free(t->render);
+    free(t);
+}
@@ -0,0 +1,118 @@
+#include "nesmu.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Single producer, single consumer ring of fixed size records, the way
+// the main thread feeds the synthesis and render threads (apu_thread.c,
+// ppu_thread.c). The writer fills a slot then publishes its index with a
+// release store, the reader acquires the index before looking at the
+// slot.
+//
+// Neither side spins or polls. A reader with nothing to read, a writer
+// with no room left, and a thread waiting for a counter such as the
+// frames done, all sleep on the ring's condition variable until the
+// value they wait on changes. Whoever changes it only takes the lock to
+// wake them when someone is asleep. The writer does not wake the reader
+// for every record either, only once the ring is half full or when it
+// asks for it with ring_flush(), before it waits on the reader.
+//
+// No wakeup is lost: a sleeper counts itself in `sleepers` and then
+// looks at the value once more under the lock, the other side stores the
+// value and then looks at `sleepers`. Both are sequentially consistent,
+// so either the sleeper sees the new value or the waker sees the sleeper
+// and signals under the lock, which the sleeper only lets go of inside
+// pthread_cond_wait().
+
+int ring_init(t_ring *ring, uint32_t size, size_t rec_size) {
+    memset(ring, 0, sizeof(*ring));
+    ring->slots = calloc(size, rec_size);
+    if (!ring->slots) {
+        return 1;
+    }
+    ring->size = size;
+    ring->rec_size = rec_size;
+
+    if (pthread_mutex_init(&ring->lock, NULL) != 0) {
+        free(ring->slots);
+        return 1;
+    }
+    if (pthread_cond_init(&ring->cond, NULL) != 0) {
+        pthread_mutex_destroy(&ring->lock);
+        free(ring->slots);
+        return 1;
+    }
+    return 0;
+}
+
+void ring_destroy(t_ring *ring) {
+    pthread_cond_destroy(&ring->cond);
+    pthread_mutex_destroy(&ring->lock);
+    free(ring->slots);
+    ring->slots = NULL;
+}
+
+// sleep as long as *word is old
+void ring_wait(t_ring *ring, atomic_uint *word, uint32_t old) {
+    if (atomic_load(word) != old) {
+        return;
+    }
+
+    pthread_mutex_lock(&ring->lock);
+    atomic_fetch_add(&ring->sleepers, 1);
+    while (atomic_load(word) == old) {
+        pthread_cond_wait(&ring->cond, &ring->lock);
+    }
+    atomic_fetch_sub(&ring->sleepers, 1);
+    pthread_mutex_unlock(&ring->lock);
+}
+
+// after a change to a value someone may be waiting on
+void ring_wake(t_ring *ring) {
+    if (atomic_load(&ring->sleepers)) {
+        pthread_mutex_lock(&ring->lock);
+        pthread_cond_broadcast(&ring->cond);
+        pthread_mutex_unlock(&ring->lock);
+    }
+}
+
+// writer. Records are never dropped, if the reader is that far behind
+// the writer waits for room.
+void ring_push(t_ring *ring, const void *rec) {
+    uint32_t w = atomic_load_explicit(&ring->write, memory_order_relaxed);
+    uint32_t r = atomic_load_explicit(&ring->read, memory_order_acquire);
+
+    while (w - r == ring->size) {
+        ring_wake(ring);
+        ring_wait(ring, &ring->read, r);
+        r = atomic_load_explicit(&ring->read, memory_order_acquire);
+    }
+
+    memcpy((uint8_t *)ring->slots + (w & (ring->size - 1)) * ring->rec_size,
+           rec, ring->rec_size);
+    atomic_store(&ring->write, w + 1);
+    if (w + 1 - r >= ring->size / 2) {
+        ring_wake(ring);
+    }
+}
+
+// writer, wake the reader for what has been pushed so far
+void ring_flush(t_ring *ring) { ring_wake(ring); }
+
+// reader, waits for the next record
+void ring_pop(t_ring *ring, void *rec) {
+    uint32_t r = atomic_load_explicit(&ring->read, memory_order_relaxed);
+
+    ring_wait(ring, &ring->write, r);
+    atomic_thread_fence(memory_order_acquire);
+    memcpy(rec,
+           (uint8_t *)ring->slots + (r & (ring->size - 1)) * ring->rec_size,
+           ring->rec_size);
+    atomic_store(&ring->read, r + 1);
+
+    // only a writer that found the ring full waits on read
+    if (atomic_load(&ring->write) - r == ring->size) {
+        ring_wake(ring);
+    }
+}
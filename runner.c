@@ -0,0 +1,262 @@
+#include "libnesmu.h"
+#include "shell.h"
+#include <dirent.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+// Batch test mode (nesmu -t): every ROM is an independent t_nes run
+// headless on a pool of worker threads. Workers only share the index of
+// the next ROM to run; each one writes its own result slot, and the
+// JSON summary is printed from the main thread once all of them joined.
+
+#define DEFAULT_MAX_FRAMES (60 * 60)
+#define RESET_DELAY_FRAMES 6 // blargg asks for at least 100 ms
+
+enum result { RES_PASS, RES_FAIL, RES_HALTED, RES_TIMEOUT, RES_ERROR };
+
+static const char *result_names[] = {"pass", "fail", "halted", "timeout",
+                                     "error"};
+
+typedef struct test {
+    char *path;
+    int result;
+    int status; // $6000, -1 without the blargg protocol
+    long frames;
+    double seconds;
+    char text[1024];
+} t_test;
+
+typedef struct runner {
+    t_test *tests;
+    int num_tests;
+    long max_frames;
+    atomic_int next;
+} t_runner;
+
+static double now_seconds(void) {
+    struct timespec ts;
+
+    (void)clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void run_test(t_test *test, long max_frames) {
+    int halted, reset_delay = 0;
+    int16_t samples[1024];
+    double start = now_seconds();
+    t_nes *nes = open_rom(test->path);
+
+    test->status = -1;
+    if (!nes) {
+        test->result = RES_ERROR;
+        return;
+    }
+
+    test->result = RES_TIMEOUT;
+    for (test->frames = 0; test->frames < max_frames; test->frames++) {
+        halted = nesmu_step_frame(nes);
+        while (nesmu_drain_audio(nes, samples, 1024) > 0) {
+        }
+
+        test->status = nesmu_test_status(nes, test->text, sizeof(test->text));
+        if (test->status == NESMU_TEST_NEED_RESET) {
+            if (++reset_delay == RESET_DELAY_FRAMES) {
+                nesmu_reset(nes);
+                reset_delay = 0;
+            }
+            continue;
+        }
+
+        if (0 <= test->status && test->status < NESMU_TEST_RUNNING) {
+            test->result = test->status ? RES_FAIL : RES_PASS;
+            break;
+        }
+
+        if (halted) {
+            test->result = (halted == NESMU_ILLEGAL_OPCODE) ? RES_ERROR
+                                                            : RES_HALTED;
+            break;
+        }
+    }
+
+    test->seconds = now_seconds() - start;
+    nesmu_destroy(nes);
+}
+
+static void *worker(void *arg) {
+    t_runner *runner = arg;
+    int i;
+
+    while ((i = atomic_fetch_add(&runner->next, 1)) < runner->num_tests) {
+        run_test(&runner->tests[i], runner->max_frames);
+    }
+    return NULL;
+}
+
+static int add_test(t_runner *runner, const char *path) {
+    t_test *tests;
+
+    tests = realloc(runner->tests, (runner->num_tests + 1) * sizeof(t_test));
+    if (!tests) {
+        perror("realloc()");
+        return 1;
+    }
+    runner->tests = tests;
+    memset(&tests[runner->num_tests], 0, sizeof(t_test));
+    tests[runner->num_tests].path = strdup(path);
+    runner->num_tests += 1;
+    return 0;
+}
+
+// a file is taken as is, a directory is searched for *.nes recursively
+static int add_tests(t_runner *runner, const char *path) {
+    struct dirent *ent;
+    struct stat st;
+    char sub[4096];
+    size_t len;
+    DIR *dir;
+
+    if (stat(path, &st) != 0) {
+        perror(path);
+        return 1;
+    }
+
+    if (!S_ISDIR(st.st_mode)) {
+        return add_test(runner, path);
+    }
+
+    dir = opendir(path);
+    if (!dir) {
+        perror(path);
+        return 1;
+    }
+
+    while ((ent = readdir(dir)) != NULL) {
+        if (ent->d_name[0] == '.')
+            continue;
+
+        (void)snprintf(sub, sizeof(sub), "%s/%s", path, ent->d_name);
+        len = strlen(sub);
+        if (stat(sub, &st) != 0)
+            continue;
+        if (S_ISDIR(st.st_mode) ||
+            (len > 4 && strcmp(sub + len - 4, ".nes") == 0)) {
+            if (add_tests(runner, sub)) {
+                closedir(dir);
+                return 1;
+            }
+        }
+    }
+
+    closedir(dir);
+    return 0;
+}
+
+static int compare_tests(const void *a, const void *b) {
+    return strcmp(((const t_test *)a)->path, ((const t_test *)b)->path);
+}
+
+void print_json_string(const char *s) {
+    putchar('"');
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\')
+            printf("\\%c", *s);
+        else if (*s == '\n')
+            fputs("\\n", stdout);
+        else if ((unsigned char)*s < 0x20)
+            printf("\\u%04x", *s);
+        else
+            putchar(*s);
+    }
+    putchar('"');
+}
+
+static void print_summary(t_runner *runner, int jobs, double seconds) {
+    int counts[5] = {0};
+
+    printf("{\n  \"jobs\": %d,\n  \"seconds\": %.3f,\n  \"tests\": [\n", jobs,
+           seconds);
+    for (int i = 0; i < runner->num_tests; i++) {
+        t_test *test = &runner->tests[i];
+
+        counts[test->result] += 1;
+        printf("    {\"rom\": ");
+        print_json_string(test->path);
+        printf(", \"result\": \"%s\", \"status\": %d, \"frames\": %ld, "
+               "\"seconds\": %.3f, \"text\": ",
+               result_names[test->result], test->status, test->frames,
+               test->seconds);
+        print_json_string(test->text);
+        printf("}%s\n", (i + 1 < runner->num_tests) ? "," : "");
+    }
+    printf("  ],\n  \"total\": %d", runner->num_tests);
+    for (int i = 0; i < 5; i++) {
+        printf(",\n  \"%s\": %d", result_names[i], counts[i]);
+    }
+    printf("\n}\n");
+}
+
+// exit status is 0 when nothing failed, timed out or could not be run
+int run_tests(char **paths, int num_paths, int jobs, long max_frames) {
+    t_runner runner;
+    pthread_t *threads;
+    double start;
+    int i, bad = 0;
+
+    memset(&runner, 0, sizeof(runner));
+    runner.max_frames = max_frames ? max_frames : DEFAULT_MAX_FRAMES;
+    atomic_init(&runner.next, 0);
+
+    for (i = 0; i < num_paths; i++) {
+        if (add_tests(&runner, paths[i])) {
+            return 1;
+        }
+    }
+    if (runner.num_tests == 0) {
+        fprintf(stderr, "no roms found\n");
+        return 1;
+    }
+    qsort(runner.tests, runner.num_tests, sizeof(t_test), compare_tests);
+
+    if (jobs <= 0) {
+        jobs = sysconf(_SC_NPROCESSORS_ONLN);
+        jobs = (jobs > 0) ? jobs : 1;
+    }
+    jobs = (jobs < runner.num_tests) ? jobs : runner.num_tests;
+
+    threads = calloc(jobs, sizeof(pthread_t));
+    if (!threads) {
+        perror("calloc()");
+        return 1;
+    }
+
+    start = now_seconds();
+    for (i = 0; i < jobs; i++) {
+        if (pthread_create(&threads[i], NULL, worker, &runner) != 0) {
+            perror("pthread_create()");
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (i = 0; i < jobs; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    print_summary(&runner, jobs, now_seconds() - start);
+
+    for (i = 0; i < runner.num_tests; i++) {
+        int r = runner.tests[i].result;
+
+        bad |= (r == RES_FAIL || r == RES_TIMEOUT || r == RES_ERROR);
+        free(runner.tests[i].path);
+    }
+    free(runner.tests);
+    free(threads);
+    return bad;
+}
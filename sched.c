@@ -0,0 +1,63 @@
+#include "nesmu.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+// Everything the CPU must not run past (vblank edges, frame sequencer
+// steps, interrupts) is queued here as a cpu cycle timestamp. cpu_run()
+// executes instructions until cpu.deadline, the earliest pending event.
+
+void sched_init(t_nes *nes) {
+    for (int i = 0; i < NUM_EVENTS; i++) {
+        nes->sched.when[i] = UINT64_MAX;
+    }
+    nes->cpu.deadline = UINT64_MAX;
+}
+
+void sched_set(t_nes *nes, int ev, uint64_t when) {
+    nes->sched.when[ev] = when;
+    if (when < nes->cpu.deadline) {
+        nes->cpu.deadline = when;
+    }
+}
+
+static uint64_t sched_next(t_nes *nes) {
+    uint64_t next = UINT64_MAX;
+
+    for (int i = 0; i < NUM_EVENTS; i++) {
+        next = (nes->sched.when[i] < next) ? nes->sched.when[i] : next;
+    }
+    return next;
+}
+
+// dispatch every event that is due, returns 1 when a frame was completed
+int sched_run(t_nes *nes) {
+    int retval = 0;
+
+    while (sched_next(nes) <= nes->cpu.cycles) {
+        for (int i = 0; i < NUM_EVENTS; i++) {
+            if (nes->sched.when[i] > nes->cpu.cycles)
+                continue;
+
+            nes->sched.when[i] = UINT64_MAX;
+            switch (i) {
+            case EV_PPU:
+                retval |= ppu_event(nes);
+                break;
+            case EV_APU_FRAME:
+                apu_frame_event(nes);
+                break;
+            case EV_APU_SYNC:
+                apu_sync_event(nes);
+                break;
+            case EV_IRQ:
+                apu_irq_event(nes);
+                break;
+            default:
+                break;
+            }
+        }
+    }
+
+    nes->cpu.deadline = sched_next(nes);
+    return retval;
+}
@@ -1,171 +1,360 @@
-#include "nesmu.h"
+#include "shell.h"
 #include <SDL.h>
-#include <assert.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Audio samples go from the emulation thread to SDL's audio callback
+// through a single producer, single consumer ring. Each side owns one
+// index and publishes it with a release store after touching the slots,
+// the other side reads it with an acquire load before touching them.
+// Neither side ever waits on the other: the callback plays silence when
+// the ring runs dry (an underrun) and audio_write() drops what does not
+// fit (an overrun).
+//
+// SDL only supports windows, events and the render API on the main
+// thread, so the emulation runs on a thread of its own (see shell_run())
+// and the main thread keeps the window: it polls events and presents
+// frames. Frames go to it through a triple buffer: video_write() copies
+// the frame into the back slot and swaps it with the ready one, the main
+// thread swaps the ready slot with the one it shows whenever a new frame
+// is there, converts it and presents it. Neither side ever waits for the
+// other, the emulation is not held up by SDL_RenderPresent() and vsync.
+// A frame replaced before the main thread took it is counted as dropped,
+// a refresh with no new frame to show as repeated. The controller state
+// and the quit request go the other way through atomics.
+//
+// The emulation is paced by a timer, not by the display or the audio
+// device, and the clocks drift apart. Dynamic rate control keeps
+// the ring around its latency target instead: audio_write() asks the
+// core for slightly more samples per frame while the ring is below the
+// target and slightly fewer while it is above. The integral term takes
+// up the steady difference between the clocks. The rate is never off by
+// more than RATE_MAX_DELTA, far below what can be heard as a change of
+// pitch.
+
+#define DEFAULT_AUDIO_LATENCY 32 // ms queued ahead of the audio device
+#define AUDIO_DEVICE_SAMPLES 512
+#define RATE_MAX_DELTA 0.005
+#define RATE_INTEGRAL 0.00002 // per frame, at full error
+#define FILL_SMOOTHING 0.05 // the fill moves by a callback's worth at once
+#define FRAME_FRESH 4         // in ready, the slot holds a frame not shown yet
+#define EVENT_POLL_MS 10       // main thread wakeup without vsync
+
+typedef struct sdl {
+    SDL_Window *window;
+    SDL_Renderer *renderer;
+    SDL_Texture *texture;
+    SDL_AudioDeviceID audio_device;
+    bool playing; // the device starts once the ring is up to its target
+
+    int16_t *buf;
+    uint32_t size;    // a power of two
+    uint32_t latency; // target fill, in samples
+    double fill;      // smoothed fill, in samples
+    double drift;     // integral term of the rate control
+    uint64_t next_frame; // performance counter deadline, timer pacing
+    atomic_uint read_index, write_index;
+    atomic_ulong underruns; // callbacks that ran out of samples
+    atomic_ulong overruns;  // samples dropped because the ring was full
+
+    // triple buffer, back is the emulation's slot and front the main
+    // thread's, ready is the third one, with FRAME_FRESH
+    t_nesmu_frame frames[3];
+    int back, front;
+    atomic_int ready;
+    bool vsync; // SDL_RenderPresent() waits for the display
+    SDL_mutex *frame_lock; // only for waking the main thread up
+    SDL_cond *frame_cond;
+    atomic_int joy1;      // controller state, from the main thread
+    atomic_bool quit;     // window closed or escape pressed
+    atomic_bool finished; // the emulation thread has returned
+    atomic_ulong dropped;  // frames replaced before they were shown
+    atomic_ulong repeated; // refreshes that showed the same frame again
+} t_sdl;
+
+// producer side, returns the number of samples queued
+static size_t audio_enqueue(t_sdl *sdl, const int16_t *samples, size_t n) {
+    uint32_t w = atomic_load_explicit(&sdl->write_index, memory_order_relaxed);
+    uint32_t r = atomic_load_explicit(&sdl->read_index, memory_order_acquire);
+    uint32_t room = sdl->size - (w - r), pos = w & (sdl->size - 1);
+    size_t first;
+
+    if (n > room) {
+        atomic_fetch_add_explicit(&sdl->overruns, n - room,
+                                  memory_order_relaxed);
+        n = room;
+    }
 
-static int16_t audio_dequeue_sample(t_nes *nes, bool *underrun) {
-    int16_t sample;
+    first = (n < sdl->size - pos) ? n : sdl->size - pos;
+    memcpy(sdl->buf + pos, samples, first * sizeof(int16_t));
+    memcpy(sdl->buf, samples + first, (n - first) * sizeof(int16_t));
+    atomic_store_explicit(&sdl->write_index, w + n, memory_order_release);
+    return n;
+}
 
-    if (nes->shell.num_available <= 0) {
-        if (!*underrun) {
-            SDL_Log("audio underrun");
-            *underrun = true;
-        }
-        return 0;
-    }
+// consumer side, returns the number of samples copied out
+static size_t audio_dequeue(t_sdl *sdl, int16_t *samples, size_t n) {
+    uint32_t r = atomic_load_explicit(&sdl->read_index, memory_order_relaxed);
+    uint32_t w = atomic_load_explicit(&sdl->write_index, memory_order_acquire);
+    uint32_t pos = r & (sdl->size - 1);
+    size_t first;
+
+    n = (n < w - r) ? n : w - r;
+    first = (n < sdl->size - pos) ? n : sdl->size - pos;
+    memcpy(samples, sdl->buf + pos, first * sizeof(int16_t));
+    memcpy(samples + first, sdl->buf, (n - first) * sizeof(int16_t));
+    atomic_store_explicit(&sdl->read_index, r + n, memory_order_release);
+    return n;
+}
 
-    sample = nes->shell.buf[nes->shell.buf_read_index];
-    nes->shell.num_available -= 1;
-    nes->shell.buf_read_index += 1;
-    nes->shell.buf_read_index %= 2048;
-    return sample;
+static uint32_t audio_queued(t_sdl *sdl) {
+    return atomic_load_explicit(&sdl->write_index, memory_order_relaxed) -
+           atomic_load_explicit(&sdl->read_index, memory_order_acquire);
 }
 
-void audio_enqueue_sample(t_nes *nes, int16_t sample) {
-    while (nes->shell.num_available > 1536) {
-        SDL_Delay(1);
+// queue the samples of a frame and work out the rate for the next one
+static void audio_write(t_shell *shell, const int16_t *samples, size_t n) {
+    t_sdl *sdl = shell->data;
+    double error;
+
+    (void)audio_enqueue(sdl, samples, n);
+    if (!sdl->playing && audio_queued(sdl) >= sdl->latency) {
+        (void)SDL_PauseAudioDevice(sdl->audio_device, 0);
+        sdl->playing = true;
     }
 
-    nes->shell.buf[nes->shell.buf_write_index] = sample;
-    nes->shell.num_available += 1;
-    nes->shell.buf_write_index += 1;
-    nes->shell.buf_write_index %= 2048;
-    return;
+    sdl->fill += (audio_queued(sdl) - sdl->fill) * FILL_SMOOTHING;
+    error = (sdl->latency - sdl->fill) / sdl->latency;
+    error = (error < 1) ? error : 1;
+    error = (error > -1) ? error : -1;
+
+    sdl->drift += RATE_INTEGRAL * error;
+    sdl->drift = (sdl->drift < RATE_MAX_DELTA) ? sdl->drift : RATE_MAX_DELTA;
+    sdl->drift = (sdl->drift > -RATE_MAX_DELTA) ? sdl->drift : -RATE_MAX_DELTA;
+
+    error = sdl->drift + RATE_MAX_DELTA * error;
+    error = (error < RATE_MAX_DELTA) ? error : RATE_MAX_DELTA;
+    error = (error > -RATE_MAX_DELTA) ? error : -RATE_MAX_DELTA;
+    shell->audio_rate = 1 + error;
 }
 
 static void audio_callback(void *userdata, Uint8 *stream, int len) {
-    (void)userdata;
+    t_sdl *sdl = ((t_shell *)userdata)->data;
     int16_t *ptr = (int16_t *)stream;
-    bool underrun = false;
+    size_t want = len / sizeof(int16_t);
+    size_t got = audio_dequeue(sdl, ptr, want);
 
-    for (int i = 0; i < len / 2; i++) {
-        ptr[i] = audio_dequeue_sample(userdata, &underrun);
+    if (got < want) {
+        memset(ptr + got, 0, (want - got) * sizeof(int16_t));
+        atomic_fetch_add_explicit(&sdl->underruns, 1, memory_order_relaxed);
     }
 }
 
-static int audio_open(t_nes *nes) {
+static int audio_open(t_shell *shell) {
+    t_sdl *sdl = shell->data;
     SDL_AudioSpec spec;
+    int latency_ms =
+        shell->audio_latency ? shell->audio_latency : DEFAULT_AUDIO_LATENCY;
+
+    // room for twice the target, so the frame on top of it always fits
+    sdl->latency = NESMU_SAMPLING_FREQUENCY / 1000 * latency_ms;
+    sdl->latency = (sdl->latency > AUDIO_DEVICE_SAMPLES)
+                       ? sdl->latency
+                       : AUDIO_DEVICE_SAMPLES;
+    for (sdl->size = 1024; sdl->size < 2 * sdl->latency; sdl->size *= 2) {
+    }
+    sdl->fill = sdl->latency;
+    sdl->buf = calloc(sdl->size, sizeof(int16_t));
+    if (!sdl->buf) {
+        return 1;
+    }
 
     (void)SDL_memset(&spec, 0, sizeof(SDL_AudioSpec));
 
-    spec.freq = SAMPLING_FREQUENCY;
+    spec.freq = NESMU_SAMPLING_FREQUENCY;
     spec.format = AUDIO_S16;
     spec.channels = 1;
-    spec.samples = 512;
-    spec.size = 512 * 2 * 1;
+    spec.samples = AUDIO_DEVICE_SAMPLES;
+    spec.size = AUDIO_DEVICE_SAMPLES * 2 * 1;
     spec.callback = &audio_callback;
-    spec.userdata = nes;
+    spec.userdata = shell;
 
-    nes->shell.audio_device = SDL_OpenAudioDevice(0, 0, &spec, 0, 0);
-    if (!nes->shell.audio_device) {
+    sdl->audio_device = SDL_OpenAudioDevice(0, 0, &spec, 0, 0);
+    if (!sdl->audio_device) {
         (void)SDL_Log("%s", SDL_GetError());
         return 1;
     }
-
-    (void)SDL_PauseAudioDevice(nes->shell.audio_device, 0);
     return 0;
 }
 
-static int audio_close(t_nes *nes) {
-    if (!nes->shell.audio_device) {
+static int audio_close(t_shell *shell) {
+    t_sdl *sdl = shell->data;
+    if (!sdl->audio_device) {
         return 1;
     }
 
-    (void)SDL_PauseAudioDevice(nes->shell.audio_device, 1);
-    (void)SDL_CloseAudioDevice(nes->shell.audio_device);
-    nes->shell.audio_device = 0;
+    (void)SDL_PauseAudioDevice(sdl->audio_device, 1);
+    (void)SDL_CloseAudioDevice(sdl->audio_device);
+    sdl->audio_device = 0;
+
+    SDL_Log("audio: %lu underruns, %lu samples dropped",
+            atomic_load(&sdl->underruns), atomic_load(&sdl->overruns));
     return 0;
 }
 
-static int video_open(t_nes *nes) {
-    nes->shell.window = SDL_CreateWindow("nesmu", 0, 0, 256, 240, 0);
-    if (!nes->shell.window) {
+static int video_open(t_shell *shell) {
+    t_sdl *sdl = shell->data;
+    sdl->window = SDL_CreateWindow("nesmu", 0, 0, NESMU_WIDTH,
+                                   NESMU_HEIGHT, 0);
+    if (!sdl->window) {
         SDL_Log("%s", SDL_GetError());
         return 1;
     }
 
-    nes->shell.renderer = SDL_CreateRenderer(nes->shell.window, -1, 0);
-    if (!nes->shell.renderer) {
+    sdl->vsync = shell->vsync;
+    sdl->renderer = SDL_CreateRenderer(
+        sdl->window, -1, sdl->vsync ? SDL_RENDERER_PRESENTVSYNC : 0);
+    if (!sdl->renderer) {
         SDL_Log("%s", SDL_GetError());
         return 1;
     }
 
-    nes->shell.texture =
-        SDL_CreateTexture(nes->shell.renderer, SDL_PIXELFORMAT_ARGB8888,
-                          SDL_TEXTUREACCESS_STREAMING, 256, 240);
-    if (!nes->shell.texture) {
+    sdl->texture =
+        SDL_CreateTexture(sdl->renderer, SDL_PIXELFORMAT_ARGB8888,
+                          SDL_TEXTUREACCESS_STREAMING, NESMU_WIDTH,
+                          NESMU_HEIGHT);
+    if (!sdl->texture) {
         SDL_Log("%s", SDL_GetError());
         return 1;
     }
 
+    sdl->back = 0;
+    sdl->front = 1;
+    atomic_store(&sdl->ready, 2);
+    sdl->frame_lock = SDL_CreateMutex();
+    sdl->frame_cond = SDL_CreateCond();
+    if (!sdl->frame_lock || !sdl->frame_cond) {
+        SDL_Log("%s", SDL_GetError());
+        return 1;
+    }
     return 0;
 }
 
-static int video_close(t_nes *nes) {
-    if (nes->shell.texture) {
-        SDL_DestroyTexture(nes->shell.texture);
-        nes->shell.texture = NULL;
+static int video_close(t_shell *shell) {
+    t_sdl *sdl = shell->data;
+
+    if (sdl->frame_cond) {
+        SDL_DestroyCond(sdl->frame_cond);
+        sdl->frame_cond = NULL;
     }
 
-    if (nes->shell.renderer) {
-        SDL_DestroyRenderer(nes->shell.renderer);
-        nes->shell.renderer = NULL;
+    if (sdl->frame_lock) {
+        SDL_DestroyMutex(sdl->frame_lock);
+        sdl->frame_lock = NULL;
     }
 
-    if (nes->shell.window) {
-        SDL_DestroyWindow(nes->shell.window);
-        nes->shell.window = NULL;
+    if (sdl->texture) {
+        SDL_DestroyTexture(sdl->texture);
+        sdl->texture = NULL;
+    }
+
+    if (sdl->renderer) {
+        SDL_DestroyRenderer(sdl->renderer);
+        sdl->renderer = NULL;
+    }
+
+    if (sdl->window) {
+        SDL_DestroyWindow(sdl->window);
+        sdl->window = NULL;
     }
 
     return 0;
 }
 
-int video_write(t_nes *nes) {
-    uint32_t *pixels;
-    int pitch, y, x;
+// timer pacing: sleep most of the way to the frame deadline, then spin
+// on the performance counter for the last couple of milliseconds
+static void frame_wait(t_sdl *sdl) {
+    uint64_t freq = SDL_GetPerformanceFrequency();
+    uint64_t period = (uint64_t)(freq / NESMU_FRAME_RATE);
+    uint64_t now = SDL_GetPerformanceCounter();
 
-    if (SDL_LockTexture(nes->shell.texture, 0, (void *)&pixels, &pitch) < 0) {
-        SDL_Log("%s", SDL_GetError());
-        return 1;
+    if (sdl->next_frame == 0 || now > sdl->next_frame + period) {
+        sdl->next_frame = now; // first frame, or too far behind to catch up
     }
 
-    for (y = 0; y < 240; y++) {
-        for (x = 0; x < 256; x++) {
-            pixels[y * 256 + x] = 0x0000ff00;
+    while (now < sdl->next_frame) {
+        if (sdl->next_frame - now > freq / 500) {
+            SDL_Delay(1);
         }
+        now = SDL_GetPerformanceCounter();
     }
+    sdl->next_frame += period;
+}
 
-    SDL_UnlockTexture(nes->shell.texture);
-    SDL_RenderClear(nes->shell.renderer);
-    SDL_RenderCopy(nes->shell.renderer, nes->shell.texture, NULL, NULL);
-    SDL_RenderPresent(nes->shell.renderer);
+// publish the frame, the main thread picks up the newest one
+static int video_write(t_shell *shell, const t_nesmu_frame *frame) {
+    t_sdl *sdl = shell->data;
+    int old;
+
+    memcpy(&sdl->frames[sdl->back], frame, sizeof(*frame));
+    old = atomic_exchange(&sdl->ready, sdl->back | FRAME_FRESH);
+    if (old & FRAME_FRESH) {
+        atomic_fetch_add_explicit(&sdl->dropped, 1, memory_order_relaxed);
+    }
+    sdl->back = old & 3;
+
+    if (!sdl->vsync) {
+        SDL_LockMutex(sdl->frame_lock);
+        SDL_CondSignal(sdl->frame_cond);
+        SDL_UnlockMutex(sdl->frame_lock);
+    }
+
+    frame_wait(sdl);
     return 0;
 }
 
-int shell_open(t_nes *nes) {
+static int shell_open(t_shell *shell) {
+    shell->data = calloc(1, sizeof(t_sdl));
+    if (!shell->data) {
+        return 1;
+    }
+
     if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO) < 0) {
         (void)SDL_Log("%s", SDL_GetError());
         return 1;
     }
 
-    return audio_open(nes) || video_open(nes);
+    return audio_open(shell) || video_open(shell);
 }
 
-int shell_close(t_nes *nes) {
-    video_close(nes);
-    audio_close(nes);
+static int shell_close(t_shell *shell) {
+    if (!shell->data) {
+        return 1;
+    }
+
+    video_close(shell);
+    audio_close(shell);
     SDL_Quit();
+    free(((t_sdl *)shell->data)->buf);
+    free(shell->data);
+    shell->data = NULL;
     return 0;
 }
 
-int poll_events(t_nes *nes, int *done) {
-    SDL_Event event;
+// emulation thread, takes what the main thread has seen of the input
+static int poll_events(t_shell *shell, int *done) {
+    t_sdl *sdl = shell->data;
 
-    (void)SDL_PollEvent(&event);
+    shell->joy1 = atomic_load_explicit(&sdl->joy1, memory_order_relaxed);
+    *done |= atomic_load_explicit(&sdl->quit, memory_order_relaxed);
+    return 0;
+}
 
-    *done |= event.type == SDL_QUIT;
-    *done |= event.key.keysym.sym == SDLK_ESCAPE;
-    if (event.type != SDL_KEYDOWN && event.type != SDL_KEYUP)
-        return 0;
+// main thread, drain the event queue
+static void pump_events(t_sdl *sdl) {
+    SDL_Event event;
+    int joy1 = atomic_load_explicit(&sdl->joy1, memory_order_relaxed);
 
     // Status for each controller is returned as an 8-bit report in the
     // following order: A, B, Select, Start, Up, Down, Left, Right.
@@ -173,14 +362,124 @@ int poll_events(t_nes *nes, int *done) {
     SDL_Keycode tab[] = {SDLK_x,  SDLK_z,    SDLK_RSHIFT, SDLK_RETURN,
                          SDLK_UP, SDLK_DOWN, SDLK_LEFT,   SDLK_RIGHT};
 
-    for (int i = 0; i < 8; i++) {
-        if (event.key.keysym.sym == tab[i]) {
-            if (event.type == SDL_KEYDOWN)
-                nes->shell.joy1 |= 1 << (7 - i);
-            else
-                nes->shell.joy1 &= ~(1 << (7 - i));
+    while (SDL_PollEvent(&event)) {
+        if (event.type == SDL_QUIT) {
+            atomic_store(&sdl->quit, true);
+        }
+        if (event.type != SDL_KEYDOWN && event.type != SDL_KEYUP)
+            continue;
+
+        if (event.key.keysym.sym == SDLK_ESCAPE) {
+            atomic_store(&sdl->quit, true);
+        }
+        for (int i = 0; i < 8; i++) {
+            if (event.key.keysym.sym == tab[i]) {
+                if (event.type == SDL_KEYDOWN)
+                    joy1 |= 1 << (7 - i);
+                else
+                    joy1 &= ~(1 << (7 - i));
+            }
         }
     }
 
+    atomic_store_explicit(&sdl->joy1, joy1, memory_order_relaxed);
+}
+
+// main thread, without vsync there is nothing to show until a new frame
+// comes, but the events are still polled now and then
+static bool frame_wait_fresh(t_sdl *sdl) {
+    SDL_LockMutex(sdl->frame_lock);
+    if (!(atomic_load(&sdl->ready) & FRAME_FRESH) &&
+        !atomic_load(&sdl->finished)) {
+        SDL_CondWaitTimeout(sdl->frame_cond, sdl->frame_lock, EVENT_POLL_MS);
+    }
+    SDL_UnlockMutex(sdl->frame_lock);
+    return atomic_load(&sdl->ready) & FRAME_FRESH;
+}
+
+// main thread, show the newest frame if there is one
+static int present(t_sdl *sdl) {
+    void *pixels;
+    int pitch;
+
+    if (!(atomic_load(&sdl->ready) & FRAME_FRESH)) {
+        atomic_fetch_add_explicit(&sdl->repeated, 1, memory_order_relaxed);
+    } else {
+        sdl->front = atomic_exchange(&sdl->ready, sdl->front) & 3;
+        if (SDL_LockTexture(sdl->texture, 0, &pixels, &pitch) < 0) {
+            SDL_Log("%s", SDL_GetError());
+            return 1;
+        }
+        // straight into the texture, there is no ARGB copy of the frame
+        nesmu_frame_to_argb(&sdl->frames[sdl->front], pixels, pitch);
+        SDL_UnlockTexture(sdl->texture);
+    }
+
+    SDL_RenderClear(sdl->renderer);
+    SDL_RenderCopy(sdl->renderer, sdl->texture, NULL, NULL);
+    SDL_RenderPresent(sdl->renderer);
+    return 0;
+}
+
+typedef struct emulation {
+    t_shell *shell;
+    int (*fn)(t_shell *, void *);
+    void *arg;
+    int ret;
+} t_emulation;
+
+static int emulation_main(void *data) {
+    t_emulation *emu = data;
+    t_sdl *sdl = emu->shell->data;
+
+    emu->ret = emu->fn(emu->shell, emu->arg);
+
+    SDL_LockMutex(sdl->frame_lock);
+    atomic_store(&sdl->finished, true);
+    SDL_CondSignal(sdl->frame_cond);
+    SDL_UnlockMutex(sdl->frame_lock);
     return 0;
 }
+
+// fn runs the emulation on a thread of its own, the calling thread, the
+// one that opened the shell, polls events and presents frames until fn
+// returns. A failure to present asks fn to stop, like closing the window.
+static int shell_run(t_shell *shell, int (*fn)(t_shell *, void *),
+                     void *arg) {
+    t_sdl *sdl = shell->data;
+    t_emulation emu = {shell, fn, arg, 0};
+    SDL_Thread *thread;
+    bool failed = false;
+
+    atomic_store(&sdl->finished, false);
+    thread = SDL_CreateThread(emulation_main, "nesmu emulation", &emu);
+    if (!thread) {
+        SDL_Log("%s", SDL_GetError());
+        return 1;
+    }
+
+    while (!atomic_load(&sdl->finished)) {
+        pump_events(sdl);
+        if (failed) {
+            SDL_Delay(EVENT_POLL_MS);
+            continue;
+        }
+        if (!sdl->vsync && !frame_wait_fresh(sdl)) {
+            continue;
+        }
+        if (present(sdl)) {
+            failed = true;
+            atomic_store(&sdl->quit, true);
+        }
+    }
+
+    SDL_WaitThread(thread, NULL);
+    SDL_Log("video: %lu frames dropped, %lu repeated",
+            atomic_load(&sdl->dropped), atomic_load(&sdl->repeated));
+    return emu.ret;
+}
+
+const t_shell_ops sdl_shell = {
+    shell_open,  shell_close, video_write,
+    poll_events, audio_write, shell_run,
+};
@@ -0,0 +1,49 @@
+#ifndef SHELL_H
+#define SHELL_H
+
+#include "libnesmu.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct shell;
+
+// video/audio/input backend of the nesmu frontend, see shell.c (SDL) and
+// headless.c. The core knows nothing about these, main.c moves frames,
+// samples and controller state between them and libnesmu.
+typedef struct shell_ops {
+    int (*open)(struct shell *);
+    int (*close)(struct shell *);
+    int (*video_write)(struct shell *, const t_nesmu_frame *);
+    int (*poll_events)(struct shell *, int *);
+    void (*audio_write)(struct shell *, const int16_t *, size_t);
+    // run the emulation loop fn(shell, arg) and return what it returns.
+    // The SDL backend runs it on another thread and keeps the window on
+    // the calling one, which must be the main thread.
+    int (*run)(struct shell *, int (*)(struct shell *, void *), void *);
+} t_shell_ops;
+
+typedef struct shell {
+    const t_shell_ops *ops;
+    void *data; // backend private state
+    uint8_t joy1;
+    int audio_latency; // ms of audio queued ahead, 0 for the default
+    bool vsync;        // present on the display's refresh
+    double audio_rate; // for nesmu_set_audio_rate(), set by audio_write
+} t_shell;
+
+extern const t_shell_ops sdl_shell;
+extern const t_shell_ops headless_shell;
+int headless_audio_file(t_shell *, const char *);
+
+// main.c
+t_nes *open_rom(const char *path);
+
+// runner.c
+int run_tests(char **paths, int num_paths, int jobs, long max_frames);
+void print_json_string(const char *);
+
+// bench.c
+int run_bench(char **paths, int num_paths, long max_frames);
+
+#endif